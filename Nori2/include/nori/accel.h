@@ -19,9 +19,18 @@
 #pragma once
 
 #include <nori/mesh.h>
+#include <nori/bvh.h>
 
 NORI_NAMESPACE_BEGIN
 
+/// Crossing of a ray with a triangle, as collected by \ref Accel::rayIntersectAll()
+struct RayCrossing {
+	/// Distance along the ray
+	float t;
+	/// Whether the ray enters the mesh, i.e. runs against the geometric normal
+	bool entering;
+};
+
 /**
  * \brief Acceleration data structure for ray intersection queries
  *
@@ -29,7 +38,8 @@ NORI_NAMESPACE_BEGIN
  * through the geometry.
  */
 class Accel {
-	friend class BVHBuildTask;
+	template <typename Tree> friend class BVHBuildTask;
+	template <typename Tree> friend float buildBVH(Tree &bvh, n_UINT size, const BoundingBox3f &bbox);
 public:
 	/// Create a new and empty BVH
 	Accel() { m_meshOffset.push_back(0u); }
@@ -68,6 +78,17 @@ public:
 	bool rayIntersect(const Ray3f &ray, Intersection &its,
 		bool shadowRay = false) const;
 
+	/**
+	 * \brief Collect every crossing of a ray with the registered meshes
+	 * in a single traversal
+	 *
+	 * When there are more than \c maxCount crossings, only the nearest
+	 * ones are kept and the traversal is pruned behind them.
+	 *
+	 * \return The number of crossings written to \c crossings, sorted by distance
+	 */
+	int rayIntersectAll(const Ray3f &ray, RayCrossing *crossings, int maxCount) const;
+
 	/// Return the total number of meshes registered with the BVH
 	n_UINT getMeshCount() const { return (n_UINT)m_meshes.size(); }
 
@@ -108,48 +129,6 @@ protected:
 		return m_meshes[meshIdx]->getCentroid(index);
 	}
 
-	/// Compute internal tree statistics
-	std::pair<float, n_UINT> statistics(n_UINT index = 0) const;
-
-	/* BVH node in 32 bytes */
-	struct BVHNode {
-		union {
-			struct {
-				unsigned flag : 1;
-				uint32_t size : 31;
-				n_UINT start;
-			} leaf;
-
-			struct {
-				unsigned flag : 1;
-				uint32_t axis : 31;
-				n_UINT rightChild;
-			} inner;
-
-			uint64_t data;
-		};
-		BoundingBox3f bbox;
-
-		bool isLeaf() const {
-			return leaf.flag == 1;
-		}
-
-		bool isInner() const {
-			return leaf.flag == 0;
-		}
-
-		bool isUnused() const {
-			return data == 0;
-		}
-
-		n_UINT start() const {
-			return leaf.start;
-		}
-
-		n_UINT end() const {
-			return leaf.start + leaf.size;
-		}
-	};
 private:
 	std::vector<Mesh *> m_meshes;		///< List of meshes registered with the BVH
 	std::vector<n_UINT> m_meshOffset;	///< Index of the first triangle for each shape
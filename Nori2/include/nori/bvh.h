@@ -0,0 +1,52 @@
+#pragma once
+
+#include <nori/bbox.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief BVH node in 32 bytes, shared by the trees built with \ref buildBVH()
+ *
+ * Inner nodes store their left child right after themselves, leaves a
+ * range of the index array of the tree.
+ */
+struct BVHNode {
+	union {
+		struct {
+			unsigned flag : 1;
+			uint32_t size : 31;
+			n_UINT start;
+		} leaf;
+
+		struct {
+			unsigned flag : 1;
+			uint32_t axis : 31;
+			n_UINT rightChild;
+		} inner;
+
+		uint64_t data;
+	};
+	BoundingBox3f bbox;
+
+	bool isLeaf() const {
+		return leaf.flag == 1;
+	}
+
+	bool isInner() const {
+		return leaf.flag == 0;
+	}
+
+	bool isUnused() const {
+		return data == 0;
+	}
+
+	n_UINT start() const {
+		return leaf.start;
+	}
+
+	n_UINT end() const {
+		return leaf.start + leaf.size;
+	}
+};
+
+NORI_NAMESPACE_END
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <nori/density.h>
+
+NORI_NAMESPACE_BEGIN
+
+/* The procedural densities are declared here rather than in density.cpp so
+   that media can call them through their concrete (final) type, letting the
+   compiler inline the noise into the tracking loops */
+
+class Cloud final : public DensityFunction {
+public:
+	explicit Cloud(const PropertyList &propList) : DensityFunction(propList) {}
+
+	virtual float eval(Vector3f p) const override {
+		p = p.cwiseQuotient(scale) - position.cwiseQuotient(scale);
+		float shape = ((p-Vector3f(1.5,0.6,-0.5)).cwiseProduct(0.75*Vector3f(0.5,1,1))).norm()-1;
+		shape = fmin(shape, ((p-Vector3f(-1.5,-0.6,0)).cwiseProduct(0.75*Vector3f(0.5,1,1))).norm()-0.9);
+		float m = fmax(3, p.y()+2);
+		// Zero when either smoothstep is, one when both are
+		float n = fbm(p+Vector3f(seed), fmax(-0.5f, (shape-0.1f)/m), fmax(0.3f, (shape+0.1f)/m));
+		return smoothstep(-0.5, 0.3, n)*smoothstep(-0.1, 0.1, -(shape-fmax(3, p.y()+2)*n));
+	}
+
+	void evalBatch(const float* xs, const float* ys, const float* zs, float* out, int n) const override {
+		evalPackets(xs, ys, zs, out, n, [this](FloatP x, FloatP y, FloatP z) {
+			x = x/scale.x() - position.x()/scale.x();
+			y = y/scale.y() - position.y()/scale.y();
+			z = z/scale.z() - position.z()/scale.z();
+			FloatP ax = (x-1.5f)*0.375f, ay = (y-0.6f)*0.75f, az = (z+0.5f)*0.75f;
+			FloatP bx = (x+1.5f)*0.375f, by = (y+0.6f)*0.75f, bz = z*0.75f;
+			FloatP shape = min(sqrt(ax*ax + ay*ay + az*az) - 1.0f, sqrt(bx*bx + by*by + bz*bz) - 0.9f);
+			FloatP m = max(FloatP(3.0f), y+2.0f);
+			FloatP noise = fbm(x+seed, y+seed, z+seed,
+				max(FloatP(-0.5f), (shape-0.1f)/m), max(FloatP(0.3f), (shape+0.1f)/m));
+			return smoothstep(-0.5f, 0.3f, noise)*smoothstep(-0.1f, 0.1f, -(shape-m*noise));
+		});
+	}
+
+	/* The density vanishes unless shape < 0.1 + max(3, y+2)*n, so with |n| <= FbmBound
+	   it is zero wherever g = shape - 0.1 - max(3, y+2)*FbmBound > 0. shape is
+	   0.75-Lipschitz and the displacement FbmBound-Lipschitz in local coordinates */
+	float emptyDistance(const Point3f& world) const override {
+		Vector3f p = (world - position).cwiseQuotient(scale);
+		float shape = ((p-Vector3f(1.5,0.6,-0.5)).cwiseProduct(0.75*Vector3f(0.5,1,1))).norm()-1;
+		shape = fmin(shape, ((p-Vector3f(-1.5,-0.6,0)).cwiseProduct(0.75*Vector3f(0.5,1,1))).norm()-0.9);
+		float g = shape - 0.1f - fmax(3, p.y()+2)*FbmBound;
+		return g > 0 ? g / (0.75f + FbmBound) * scale.cwiseAbs().minCoeff() : 0.0f;
+	}
+
+	std::string toString() const override {
+		return tfm::format(
+				"Cloud[\n"
+				"  seed = %f,\n"
+				"  noise_mode = %s,\n"
+				"  noise_texture = %s,\n"
+				"  animation = %s\n"
+				"]",
+				seed,
+				noiseModeName(),
+				indent(noiseTextureName(), 2),
+				animationName());
+	}
+};
+
+class CloudSmall final : public DensityFunction {
+public:
+	explicit CloudSmall(const PropertyList &propList) : DensityFunction(propList) {}
+
+	virtual float eval(Vector3f p) const override {
+		p = p.cwiseQuotient(scale) - position.cwiseQuotient(scale);
+		float shape = (p.cwiseProduct(0.75*Vector3f(0.5,1,1))).norm()-1;
+		float n = fbm(p+Vector3f(seed), fmax(-0.5f, (shape-0.1f)/3), fmax(0.3f, (shape+0.1f)/3));
+		return smoothstep(-0.5, 0.3, n)*smoothstep(-0.1, 0.1, -(shape-3*n));
+	}
+
+	void evalBatch(const float* xs, const float* ys, const float* zs, float* out, int n) const override {
+		evalPackets(xs, ys, zs, out, n, [this](FloatP x, FloatP y, FloatP z) {
+			x = x/scale.x() - position.x()/scale.x();
+			y = y/scale.y() - position.y()/scale.y();
+			z = z/scale.z() - position.z()/scale.z();
+			FloatP ax = x*0.375f, ay = y*0.75f, az = z*0.75f;
+			FloatP shape = sqrt(ax*ax + ay*ay + az*az) - 1.0f;
+			FloatP noise = fbm(x+seed, y+seed, z+seed,
+				max(FloatP(-0.5f), (shape-0.1f)*(1.0f/3)), max(FloatP(0.3f), (shape+0.1f)*(1.0f/3)));
+			return smoothstep(-0.5f, 0.3f, noise)*smoothstep(-0.1f, 0.1f, -(shape-3.0f*noise));
+		});
+	}
+
+	/* Zero unless shape < 0.1 + 3*n, the ellipsoid is 0.75-Lipschitz in local coordinates */
+	float emptyDistance(const Point3f& world) const override {
+		Vector3f p = (world - position).cwiseQuotient(scale);
+		float g = (p.cwiseProduct(0.75*Vector3f(0.5,1,1))).norm() - 1 - 0.1f - 3*FbmBound;
+		return g > 0 ? g / 0.75f * scale.cwiseAbs().minCoeff() : 0.0f;
+	}
+
+	std::string toString() const override {
+		return tfm::format(
+				"Cloud[\n"
+				"  seed = %f,\n"
+				"  noise_mode = %s,\n"
+				"  noise_texture = %s,\n"
+				"  animation = %s\n"
+				"]",
+				seed,
+				noiseModeName(),
+				indent(noiseTextureName(), 2),
+				animationName());
+	}
+};
+
+class Sky final : public DensityFunction {
+public:
+	explicit Sky(const PropertyList &propList) : DensityFunction(propList) {}
+
+	virtual float eval(Vector3f p) const override {
+		p = p.cwiseProduct(scale) + position;
+		float h = smoothstep(0.01, -0.11, (p.y()-0.5));
+		// Below the layer no octave is needed at all
+		float n = fbm(0.1*p+Vector3f(seed), h == 0 ? INFINITY : 0.0f, 0.3f);
+		return smoothstep(0, 0.3, n)*h;
+	}
+
+	void evalBatch(const float* xs, const float* ys, const float* zs, float* out, int n) const override {
+		evalPackets(xs, ys, zs, out, n, [this](FloatP x, FloatP y, FloatP z) {
+			x = x*scale.x() + position.x();
+			y = y*scale.y() + position.y();
+			z = z*scale.z() + position.z();
+			FloatP h = smoothstep(0.01f, -0.11f, y-0.5f);
+			FloatP noise = fbm(0.1f*x+seed, 0.1f*y+seed, 0.1f*z+seed,
+				select(h == FloatP(0.0f), FloatP(INFINITY), FloatP(0.0f)), FloatP(0.3f));
+			return smoothstep(0.0f, 0.3f, noise)*h;
+		});
+	}
+
+	/* The reversed smoothstep is a step up at y - 0.5 = 0.01, so the density is
+	   zero below the plane y = 0.51 in local coordinates, whatever the noise */
+	float emptyDistance(const Point3f& world) const override {
+		float g = 0.51f - (world.y()*scale.y() + position.y());
+		return g > 0 ? g / std::abs(scale.y()) : 0.0f;
+	}
+
+	std::string toString() const override {
+		return tfm::format(
+				"Sky[\n"
+				"  seed = %f,\n"
+				"  noise_mode = %s,\n"
+				"  noise_texture = %s,\n"
+				"  animation = %s\n"
+				"]",
+				seed,
+				noiseModeName(),
+				indent(noiseTextureName(), 2),
+				animationName());
+	}
+};
+
+NORI_NAMESPACE_END
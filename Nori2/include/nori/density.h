@@ -2,14 +2,59 @@
 
 #include "common.h"
 #include <nori/object.h>
+#include <nori/simd.h>
+#include <nori/noisetexture.h>
+#include <nori/warp.h>
+#include <pcg32.h>
+#include <cstring>
+#include <memory>
 
 NORI_NAMESPACE_BEGIN
 
+/// How perlin() picks the gradient at each lattice corner
+enum ENoiseMode {
+	/// Shadertoy hash + spherical angles, kept for pixel-exact old renders
+	ENoiseHash = 0,
+	/// Seeded permutation table over precomputed unit gradients (improved Perlin noise)
+	ENoiseTable
+};
+
 class DensityFunction : public NoriObject {
 protected:
 	float seed;
 	Vector3f scale, position;
 
+	ENoiseMode noiseMode;
+	/// Permutation of [0, 256) stored twice so that nested lookups never wrap
+	int perm[512];
+	/// Unit gradients indexed by the permutation (SoA, also used by the packet path)
+	float gradX[256], gradY[256], gradZ[256];
+
+	/// Tileable perlin() read by the first octaves of fbm() (null = all octaves procedural)
+	std::unique_ptr<NoiseTexture> m_noiseTexture;
+	/// Octaves of fbm() read from the noise texture
+	int noiseTextureOctaves;
+
+	// Fills the permutation and gradient tables from the density seed
+	void buildNoiseTables() {
+		uint32_t seedBits;
+		memcpy(&seedBits, &seed, sizeof(float));
+		pcg32 rng;
+		rng.seed(seedBits);
+		for (int i = 0; i < 256; i++) {
+			perm[i] = i;
+			Vector3f g = Warp::squareToUniformSphere(Point2f(rng.nextFloat(), rng.nextFloat()));
+			gradX[i] = g.x(); gradY[i] = g.y(); gradZ[i] = g.z();
+		}
+		rng.shuffle(perm, perm + 256);
+		for (int i = 0; i < 256; i++) perm[256 + i] = perm[i];
+	}
+
+	// Gradient table index of the lattice corner (x, y, z)
+	int gradientIndex(int x, int y, int z) const {
+		return perm[perm[perm[x & 255] + (y & 255)] + (z & 255)];
+	}
+
 	// Smoothstep
 	float smoothstep(float a, float b, float x) const {
 		if (x <= a) return 0;
@@ -34,6 +79,10 @@ protected:
 
 	// Random normalized 3D vector
 	Vector3f randVec(Vector3f p) const {
+		if (noiseMode == ENoiseTable) {
+			int g = gradientIndex((int) p.x(), (int) p.y(), (int) p.z());
+			return Vector3f(gradX[g], gradY[g], gradZ[g]);
+		}
 		Vector2f r = hash23(p);
 		float th = acos(2.*r.x()-1.);
 		float phi = 2.*M_PI*r.y();
@@ -57,27 +106,290 @@ protected:
 			lerp(lerp(ldf, rdf, s.x()), lerp(luf, ruf, s.x()), s.y()), s.z());
 	}
 
+	// 3D perlin noise repeating every period lattice cells (corners are wrapped before hashing)
+	float perlinPeriodic(Vector3f p, int period) const {
+		Vector3f i = Vector3f(floor(p.x()), floor(p.y()), floor(p.z()));
+		Vector3f f = p-i;
+		Vector3f s = 3*f.cwiseProduct(f) - 2*f.cwiseProduct(f.cwiseProduct(f)); // smoothstep
+		auto corner = [&](float x, float y, float z) {
+			Vector3f c = i + Vector3f(x, y, z);
+			Vector3f w(c.x() - period*floor(c.x()/period), c.y() - period*floor(c.y()/period), c.z() - period*floor(c.z()/period));
+			return randVec(w).dot(f-Vector3f(x, y, z));
+		};
+		return lerp(lerp(lerp(corner(0,0,0), corner(1,0,0), s.x()), lerp(corner(0,1,0), corner(1,1,0), s.x()), s.y()),
+			lerp(lerp(corner(0,0,1), corner(1,0,1), s.x()), lerp(corner(0,1,1), corner(1,1,1), s.x()), s.y()), s.z());
+	}
+
 	#define OCTAVES 8
+	/* Bound of |perlin()|: gradient noise with unit gradients stays within
+	   sqrt(3)/2. The octave amplitudes of fbm() sum to 1 - 2^-OCTAVES */
+	static constexpr float PerlinBound = 0.8661f;
+	static constexpr float FbmBound = PerlinBound * (1.0f - 1.0f / (1 << OCTAVES));
+	/* Slack added to the bound of the remaining octaves before stopping early,
+	   it covers the rounding of the partial sums and of the caller's tests */
+	static constexpr float FbmSaturationSlack = 1e-4f;
+
+	/// Whether fbm() may stop before the last octave (see the interval overloads)
+	bool earlyOctaveExit;
+
+	/// Drift of the noise per unit of time, in the units of the fbm() input
+	Vector3f wind;
+	/// Drift of each octave along its own direction, in its lattice cells per unit of time
+	float evolution;
+	/// Time the noise is evaluated at
+	float time;
+	/// Offset added to the input of each octave at the current time
+	Vector3f octaveOffset[OCTAVES];
+
+	/* Scrolling the whole domain by the wind keeps the shape of the clouds, the
+	   per-octave drift lets the detail evolve at the same pace at every scale.
+	   Both are offsets of the octave inputs, so the noise texture stays valid */
+	void updateOctaveOffsets() {
+		float frequency = 1;
+		for (int i = 0; i < OCTAVES; i++) {
+			int g = perm[i];
+			octaveOffset[i] = (evolution * Vector3f(gradX[g], gradY[g], gradZ[g]) - frequency * wind) * time;
+			frequency *= 2;
+		}
+	}
+
+	// Octave i of fbm(), read from the noise texture when it covers it
+	float octave(int i, Vector3f p) const {
+		p += octaveOffset[i];
+		return m_noiseTexture && i < noiseTextureOctaves ? m_noiseTexture->lookup(p) : perlin(p);
+	}
+
 	// 3D fractal noise
 	float fbm(Vector3f p) const {
 		float r = 0;
 		float a = 0.5;
 		for (int i = 0; i < OCTAVES; i++) {
-			r += a*perlin(p);
+			r += a*octave(i, p);
 			a *= 0.5;
 			p *= 2;
 		}
 		return r;
 	}
+
+	/**
+	 * \brief fbm() for callers that saturate outside <tt>(lo, hi)</tt>
+	 *
+	 * Before each octave, the remaining ones can move the sum by at most
+	 * <tt>PerlinBound * (2a - 2^-OCTAVES)</tt>. Once that cannot bring it back
+	 * into the interval, the partial sum is returned: it lies on the same
+	 * side as the full one, so a caller that is constant at or below \c lo and
+	 * at or above \c hi gets bit-identical results. Inside the interval the
+	 * same operations as fbm() run in the same order.
+	 */
+	float fbm(Vector3f p, float lo, float hi) const {
+		if (!earlyOctaveExit)
+			return fbm(p);
+		float r = 0;
+		float a = 0.5;
+		for (int i = 0; i < OCTAVES; i++) {
+			float rest = PerlinBound * (2*a - 1.0f / (1 << OCTAVES)) + FbmSaturationSlack;
+			if (r + rest <= lo || r - rest >= hi)
+				return r;
+			r += a*octave(i, p);
+			a *= 0.5;
+			p *= 2;
+		}
+		return r;
+	}
+
+	/* Packet versions of the above, evaluating FloatP::Size points at once.
+	   randVec() is rewritten without acos (cos(acos(u)) = u) and with a
+	   polynomial sincos, so results match the scalar path up to float rounding */
+
+	FloatP smoothstep(float a, float b, FloatP x) const {
+		FloatP t = (x-a) / (b-a);
+		FloatP r = t*t*(3.0f-2.0f*t);
+		r = select(x >= FloatP(b), FloatP(1.0f), r);
+		return select(x <= FloatP(a), FloatP(0.0f), r);
+	}
+
+	FloatP lerp(FloatP a, FloatP b, FloatP t) const {
+		return (1.0f-t)*a + t*b;
+	}
+
+	// Rand 2D, same hash as hash23()
+	void hash23(FloatP x, FloatP y, FloatP z, FloatP& r0, FloatP& r1) const {
+		x = fract(x*0.1031f);
+		y = fract(y*0.1030f);
+		z = fract(z*0.0973f);
+		// Same association as Eigen's unrolled 3D dot product, the hash is sensitive to it
+		FloatP d = x*(y+33.33f) + (y*(z+33.33f) + z*(x+33.33f));
+		x += d; y += d; z += d;
+		r0 = fract((x+y)*z);
+		r1 = fract((x+z)*y);
+	}
+
+	// Dot product of the corner gradient at (ix, iy, iz) with the offset (fx, fy, fz)
+	FloatP gradDot(FloatP ix, FloatP iy, FloatP iz, FloatP fx, FloatP fy, FloatP fz) const {
+		if (noiseMode == ENoiseTable) {
+			// Gather the table gradients lane by lane
+			float x[FloatP::Size], y[FloatP::Size], z[FloatP::Size];
+			ix.store(x); iy.store(y); iz.store(z);
+			for (int j = 0; j < FloatP::Size; j++) {
+				int g = gradientIndex((int) x[j], (int) y[j], (int) z[j]);
+				x[j] = gradX[g]; y[j] = gradY[g]; z[j] = gradZ[g];
+			}
+			return FloatP::load(x)*fx + FloatP::load(y)*fy + FloatP::load(z)*fz;
+		}
+		FloatP r0, r1;
+		hash23(ix, iy, iz, r0, r1);
+		FloatP cth = 2.0f*r0 - 1.0f;
+		FloatP sth = sqrt(max(FloatP(0.0f), 1.0f - cth*cth));
+		FloatP sphi, cphi;
+		sincos2PiP(r1, sphi, cphi);
+		return cth*sphi*fx + cphi*fy + sth*sphi*fz;
+	}
+
+	// 3D perlin noise
+	FloatP perlin(FloatP px, FloatP py, FloatP pz) const {
+		FloatP ix = floor(px), iy = floor(py), iz = floor(pz);
+		FloatP fx = px-ix, fy = py-iy, fz = pz-iz;
+		FloatP sx = fx*fx*(3.0f-2.0f*fx), sy = fy*fy*(3.0f-2.0f*fy), sz = fz*fz*(3.0f-2.0f*fz);
+		FloatP ix1 = ix+1.0f, iy1 = iy+1.0f, iz1 = iz+1.0f;
+		FloatP gx = fx-1.0f, gy = fy-1.0f, gz = fz-1.0f;
+		FloatP ldb = gradDot(ix,  iy,  iz,  fx, fy, fz);
+		FloatP rdb = gradDot(ix1, iy,  iz,  gx, fy, fz);
+		FloatP lub = gradDot(ix,  iy1, iz,  fx, gy, fz);
+		FloatP rub = gradDot(ix1, iy1, iz,  gx, gy, fz);
+		FloatP ldf = gradDot(ix,  iy,  iz1, fx, fy, gz);
+		FloatP rdf = gradDot(ix1, iy,  iz1, gx, fy, gz);
+		FloatP luf = gradDot(ix,  iy1, iz1, fx, gy, gz);
+		FloatP ruf = gradDot(ix1, iy1, iz1, gx, gy, gz);
+		return lerp(lerp(lerp(ldb, rdb, sx), lerp(lub, rub, sx), sy),
+			lerp(lerp(ldf, rdf, sx), lerp(luf, ruf, sx), sy), sz);
+	}
+
+	// 3D fractal noise
+	FloatP octave(int i, FloatP px, FloatP py, FloatP pz) const {
+		px += octaveOffset[i].x(); py += octaveOffset[i].y(); pz += octaveOffset[i].z();
+		return m_noiseTexture && i < noiseTextureOctaves ? m_noiseTexture->lookup(px, py, pz) : perlin(px, py, pz);
+	}
+
+	FloatP fbm(FloatP px, FloatP py, FloatP pz) const {
+		return fbm(px, py, pz, FloatP(-INFINITY), FloatP(INFINITY));
+	}
+
+	// Stops once every lane is saturated, lanes that saturate earlier keep accumulating
+	FloatP fbm(FloatP px, FloatP py, FloatP pz, FloatP lo, FloatP hi) const {
+		if (!earlyOctaveExit) {
+			lo = FloatP(-INFINITY);
+			hi = FloatP(INFINITY);
+		}
+		FloatP r(0.0f);
+		float a = 0.5f;
+		for (int i = 0; i < OCTAVES; i++) {
+			float rest = PerlinBound * (2*a - 1.0f / (1 << OCTAVES)) + FbmSaturationSlack;
+			if (!any((r + rest > lo) & (r - rest < hi)))
+				return r;
+			r += a*octave(i, px, py, pz);
+			a *= 0.5f;
+			px *= 2.0f; py *= 2.0f; pz *= 2.0f;
+		}
+		return r;
+	}
+
+	/**
+	 * Runs a packet kernel <tt>FloatP(FloatP x, FloatP y, FloatP z)</tt> over
+	 * SoA input. The last partial packet is padded with its final point.
+	 */
+	template <typename Kernel>
+	void evalPackets(const float* xs, const float* ys, const float* zs, float* out, int n,
+	                 const Kernel& kernel) const {
+		int i = 0;
+		for (; i + FloatP::Size <= n; i += FloatP::Size)
+			kernel(FloatP::load(xs+i), FloatP::load(ys+i), FloatP::load(zs+i)).store(out+i);
+		if (i == n) return;
+
+		float tx[FloatP::Size], ty[FloatP::Size], tz[FloatP::Size], to[FloatP::Size];
+		for (int j = 0; j < FloatP::Size; j++) {
+			int k = std::min(i+j, n-1);
+			tx[j] = xs[k]; ty[j] = ys[k]; tz[j] = zs[k];
+		}
+		kernel(FloatP::load(tx), FloatP::load(ty), FloatP::load(tz)).store(to);
+		for (int j = 0; i+j < n; j++) out[i+j] = to[j];
+	}
 public:
 	DensityFunction(const PropertyList &propList) {
 		seed = propList.getFloat("seed", 0.0f);
 		scale = propList.getVector("scale", Vector3f(1));
 		position = propList.getVector("position", Vector3f(0));
+
+		std::string mode = propList.getString("noise_mode", "hash");
+		if (mode == "hash") noiseMode = ENoiseHash;
+		else if (mode == "table") noiseMode = ENoiseTable;
+		else throw NoriException("DensityFunction: unknown noise_mode \"%s\" (expected \"hash\" or \"table\")", mode);
+		buildNoiseTables();
+		earlyOctaveExit = propList.getBoolean("fbm_early_exit", true);
+		wind = propList.getVector("wind", Vector3f(0));
+		evolution = propList.getFloat("evolution", 0.0f);
+		setTime(propList.getFloat("time", 0.0f));
+
+		/* Optionally read the first octaves from a tileable texture, cached on disk */
+		int textureResolution = propList.getInteger("noise_texture_resolution", 0);
+		noiseTextureOctaves = clamp(propList.getInteger("noise_texture_octaves", 4), 1, OCTAVES);
+		if (textureResolution > 0) {
+			int period = propList.getInteger("noise_texture_period", 16);
+			uint32_t seedBits;
+			memcpy(&seedBits, &seed, sizeof(float));
+			m_noiseTexture.reset(new NoiseTexture(textureResolution, period));
+			m_noiseTexture->load(propList.getString("noise_cache", ""), (uint32_t) noiseMode, seedBits,
+				[this, period](const Vector3f& p) { return perlinPeriodic(p, period); });
+		}
 	}
 
+	/// Description of the noise texture, for toString()
+	std::string noiseTextureName() const {
+		if (!m_noiseTexture) return "none";
+		return tfm::format("%i octaves of %s", noiseTextureOctaves, m_noiseTexture->toString());
+	}
+
+	/// Whether the density changes with \ref setTime()
+	bool isAnimated() const { return !wind.isZero() || evolution != 0; }
+
+	/// Moves the noise to \c time (frames when rendering a sequence)
+	void setTime(float t) {
+		time = t;
+		updateOctaveOffsets();
+	}
+
+	float getTime() const { return time; }
+
+	/// Description of the animation, for toString()
+	std::string animationName() const {
+		if (!isAnimated()) return "static";
+		return tfm::format("wind = %s, evolution = %f, time = %f", wind.toString(), evolution, time);
+	}
+
+	/// Name of the noise mode, for toString()
+	std::string noiseModeName() const { return noiseMode == ENoiseTable ? "table" : "hash"; }
+
 	virtual float eval(Vector3f p) const = 0;
 
+	/**
+	 * \brief Conservative distance from \c p to the nearest non-zero density
+	 *
+	 * Densities shaped by an analytic bound return a distance within which
+	 * \ref eval() is guaranteed to be exactly zero, so that trackers can leap
+	 * over it. The default of 0 means no such guarantee.
+	 */
+	virtual float emptyDistance(const Point3f& p) const { return 0.0f; }
+
+	/**
+	 * \brief Evaluates the density at \c n points given in SoA layout
+	 *
+	 * The default implementation loops over \ref eval(). Densities built on
+	 * fbm() override it with the packet path, which evaluates
+	 * FloatP::Size points per instruction.
+	 */
+	virtual void evalBatch(const float* xs, const float* ys, const float* zs, float* out, int n) const {
+		for (int i = 0; i < n; i++) out[i] = eval(Vector3f(xs[i], ys[i], zs[i]));
+	}
+
 	EClassType getClassType() const override{ return EDensityFunction; }
 
 };
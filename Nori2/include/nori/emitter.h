@@ -127,6 +127,19 @@ public:
 	 */
 	virtual Color3f eval(const EmitterQueryRecord &lRec) const = 0;
 
+	/**
+	 * \brief Sample a ray leaving the emitter, for tracing light paths
+	 *
+	 * \param ray		 The sampled ray
+	 * \param posSample  A uniformly distributed sample on \f$[0,1]^2\f$ for its origin
+	 * \param dirSample  A uniformly distributed sample on \f$[0,1]^2\f$ for its direction
+	 *
+	 * \return The power carried by the ray divided by its probability density
+	 */
+	virtual Color3f samplePhoton(Ray3f &ray, const Point2f &posSample, const Point2f &dirSample) const {
+		throw NoriException("Emitter::samplePhoton(): not supported by this emitter!");
+	}
+
 	/**
 	 * \brief Virtual destructor
 	 * */
@@ -10,7 +10,9 @@
 #include <nori/bbox.h>
 #include <nori/dpdf.h>
 #include <nori/density.h>
+#include <algorithm>
 #include <utility>
+#include <vector>
 
 NORI_NAMESPACE_BEGIN
 
@@ -38,22 +40,144 @@ struct MediaCoeffs {
 };
 
 
+/**
+ * \brief Spans of a ray inside the bounding mesh of a medium
+ *
+ * Holds the sorted, disjoint <tt>[tEnter, tExit]</tt> intervals found by a
+ * single traversal of the mesh, so concave meshes bound the medium tightly
+ * and the samplers skip the gaps between the intervals. The first ones are
+ * stored inline, the rest of a ray through a lumpy mesh spills to the heap.
+ */
 struct MediaBoundaries {
+	/// Intervals stored inline
+	static constexpr int MaxIntervals = 8;
+	/// Mesh crossings collected per traversal of the mesh
+	static constexpr int MaxCrossings = 2 * MaxIntervals;
+
 	/// Associated pMedia
 	const PMedia* pMedia;
 	/// Intersected with geometry
 	bool intersected;
-	/// Distance to reach to enter boundary
+	/// Distance to reach to enter boundary (first interval)
 	float tBoundary;
 	/// Initial ray was inside
 	bool wasInside;
-	/// Distance to reach to exit boundary
+	/// Distance to reach to exit boundary (last interval)
 	float tOut;
+	/// Number of intervals
+	int intervalCount;
 
 	MediaBoundaries() {}
 
-	MediaBoundaries(const PMedia* _pMedia, bool _intersected, float _tBoundary, bool _wasInside, float _tOut) :
-			pMedia(_pMedia), intersected(_intersected), tBoundary(_tBoundary), wasInside(_wasInside), tOut(_tOut) {}
+	explicit MediaBoundaries(const PMedia* _pMedia) :
+			pMedia(_pMedia), intersected(false), tBoundary(0.0f), wasInside(false), tOut(0.0f), intervalCount(0) {}
+
+	/// Entry and exit distances of the interval \c i, in increasing order
+	float tEnter(int i) const { return i < MaxIntervals ? m_tEnter[i] : m_spill[2 * (i - MaxIntervals)]; }
+	float tExit(int i) const { return i < MaxIntervals ? m_tExit[i] : m_spill[2 * (i - MaxIntervals) + 1]; }
+
+	/// Appends the interval <tt>[t0, t1]</tt> past the previous ones
+	void addInterval(float t0, float t1) {
+		if (intervalCount > 0 && t0 <= tExit(intervalCount - 1)) {
+			tOut = std::max(tOut, t1);
+			if (intervalCount <= MaxIntervals) m_tExit[intervalCount - 1] = tOut;
+			else m_spill.back() = tOut;
+			return;
+		}
+		if (intervalCount == 0) tBoundary = t0;
+		if (intervalCount < MaxIntervals) {
+			m_tEnter[intervalCount] = t0;
+			m_tExit[intervalCount] = t1;
+		} else {
+			m_spill.push_back(t0);
+			m_spill.push_back(t1);
+		}
+		intervalCount++;
+		tOut = t1;
+		intersected = true;
+	}
+
+	/// Length of the ray inside the medium up to distance \c t
+	float lengthInside(float t) const {
+		float length = 0.0f;
+		for (int i = 0; i < intervalCount && tEnter(i) < t; i++)
+			length += std::min(t, tExit(i)) - tEnter(i);
+		return length;
+	}
+
+	/// Whether the point at distance \c t is inside the medium
+	bool contains(float t) const {
+		for (int i = 0; i < intervalCount && tEnter(i) <= t; i++)
+			if (t <= tExit(i)) return true;
+		return false;
+	}
+
+	/// The intervals before distance \c t
+	MediaBoundaries upTo(float t) const {
+		MediaBoundaries clipped(pMedia);
+		for (int i = 0; i < intervalCount && tEnter(i) < t; i++)
+			clipped.addInterval(tEnter(i), std::min(tExit(i), t));
+		clipped.wasInside = wasInside;
+		return clipped;
+	}
+
+	/// The intervals past distance \c t, measured from the point at that distance
+	MediaBoundaries from(float t) const {
+		MediaBoundaries rest(pMedia);
+		for (int i = 0; i < intervalCount; i++)
+			if (tExit(i) > t) rest.addInterval(std::max(tEnter(i) - t, 0.0f), tExit(i) - t);
+		rest.wasInside = contains(t);
+		return rest;
+	}
+
+private:
+	float m_tEnter[MaxIntervals], m_tExit[MaxIntervals];
+	/// Entry and exit distances of the intervals past the inline ones, interleaved
+	std::vector<float> m_spill;
+};
+
+
+/**
+ * \brief Boundaries of the media along a ray, nearest entry first
+ *
+ * Stored inline up to a fixed capacity, so that path vertices and shadow
+ * rays usually never touch the heap. A ray crossing more media than that
+ * moves the whole list to the heap, so none is dropped.
+ */
+class MediaBoundariesList {
+public:
+	static constexpr int Capacity = 16;
+
+	MediaBoundariesList() : m_size(0) {}
+
+	/// Inserts \c medBound in entry order
+	void insert(const MediaBoundaries& medBound) {
+		if (m_size == Capacity && m_overflow.empty())
+			m_overflow.assign(m_items, m_items + Capacity);
+		m_size++;
+		if (!m_overflow.empty()) {
+			auto pos = std::upper_bound(m_overflow.begin(), m_overflow.end(), medBound,
+					[](const MediaBoundaries& a, const MediaBoundaries& b) { return a.tBoundary < b.tBoundary; });
+			m_overflow.insert(pos, medBound);
+			return;
+		}
+		int i = m_size - 1;
+		for (; i > 0 && m_items[i - 1].tBoundary > medBound.tBoundary; i--)
+			m_items[i] = m_items[i - 1];
+		m_items[i] = medBound;
+	}
+
+	void clear() { m_size = 0; m_overflow.clear(); }
+	int size() const { return m_size; }
+	bool empty() const { return m_size == 0; }
+	const MediaBoundaries& operator[](int i) const { return begin()[i]; }
+	const MediaBoundaries* begin() const { return m_overflow.empty() ? m_items : m_overflow.data(); }
+	const MediaBoundaries* end() const { return begin() + m_size; }
+private:
+	MediaBoundaries m_items[Capacity];
+	/// All the boundaries, once there are more than \c Capacity
+	std::vector<MediaBoundaries> m_overflow;
+	int m_size;
 };
 
 
@@ -78,6 +202,23 @@ struct MediaIntersection {
 };
 
 
+/**
+ * \brief Octaves of the approximate multiple scattering (Wrenninge et al. 2013)
+ *
+ * Octave \c i scales the scattering by <tt>a^i</tt>, the optical depth
+ * toward the light by <tt>b^i</tt> and the phase function anisotropy by
+ * <tt>c^i</tt>. Summed at a single scattering event, the octaves stand in
+ * for the higher orders a path tracer needs many bounces to reach.
+ */
+struct ScatteringOctaves {
+	/// Number of octaves (1 = single scattering, i.e. disabled)
+	int count = 1;
+	float a = 0.5f, b = 0.5f, c = 0.5f;
+
+	bool enabled() const { return count > 1; }
+};
+
+
 class PMedia : public NoriObject {
 protected:
 	/// Bounding box
@@ -92,6 +233,9 @@ protected:
 	/// Max free path coefficient
 	float mu_max = 0.0f;
 
+	/// Approximate multiple scattering, disabled by default
+	ScatteringOctaves m_octaves;
+
 public:
 	PMedia();
 
@@ -111,12 +255,38 @@ public:
 	/// Ray intersection with media boundaries
 	bool rayIntersectBoundaries(const Ray3f& ray, MediaBoundaries& mediaBoundaries) const;
 
+	/// Precomputes what \ref lightTransmittance() needs for the \c lights of the scene (nothing by default)
+	virtual void cacheLightTransmittance(const std::vector<Emitter*>& lights) {}
+
+	/// Transmittance between \c x0 and \c xz, a point on the emitter \c light
+	virtual float lightTransmittance(const Point3f& x0, const Point3f& xz, const Emitter* light, const MediaBoundaries& medBound, Sampler* sampler) const {
+		return transmittance(x0, xz, medBound, sampler);
+	}
+
+	/// Estimate of the optical depth between \c x0 and \c xz, a point on the emitter \c light
+	virtual float opticalDepth(const Point3f& x0, const Point3f& xz, const Emitter* light, const MediaBoundaries& medBound, Sampler* sampler) const = 0;
+
+	/// Moves animated media to \c time, rebuilding what was derived from their density
+	virtual void setTime(float time) {}
+
+	/// Counters gathered while rendering, printed after the render (empty if none)
+	virtual std::string getStatistics() const { return ""; }
+
+	/// Bounds of the mesh enclosing the media
+	const BoundingBox3f& getBoundingBox() const { return m_accel->getBoundingBox(); }
+
+	/// Approximate multiple scattering of the media
+	const ScatteringOctaves& getScatteringOctaves() const { return m_octaves; }
+
 	/// Phase function getter
 	const PhaseFunction* getPhaseFunction() const { return m_phaseFunction; }
 
 	/// Gets max free path coefficient
 	float getMu_t() const { return mu_max; }
 
+	/// Whether the extinction is the same everywhere inside the mesh, i.e. there are no null collisions
+	virtual bool isHomogeneous() const { return false; }
+
 	EClassType getClassType() const override{ return EMedium; }
 
 	void addChild(NoriObject *obj, const std::string& name);
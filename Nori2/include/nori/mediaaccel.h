@@ -0,0 +1,92 @@
+#pragma once
+
+#include <nori/bbox.h>
+#include <vector>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Top-level BVH over the bounding boxes of the participating media
+ *
+ * Each leaf holds one medium, whose own \ref Accel over its bounding mesh
+ * acts as the bottom level. Queries visit the media whose bounds the ray
+ * crosses front to back, so that a caller that already found what it was
+ * looking for can shorten the ray and skip the media behind.
+ */
+class MediaAccel {
+public:
+	/// Build the BVH over the bounds of \c media
+	void build(const std::vector<PMedia*>& media);
+
+	/// Whether there is any medium at all
+	bool empty() const { return m_nodes.empty(); }
+
+	/**
+	 * \brief Visit the media whose bounds intersect <tt>[ray.mint, ray.maxt]</tt>,
+	 * nearest subtree first
+	 *
+	 * \param f
+	 *	 Called as <tt>f(media, tEntry)</tt> with the distance at which the
+	 *	 ray enters the bounds of the medium. It returns the distance past
+	 *	 which nothing is needed anymore, and the traversal skips the
+	 *	 subtrees that start beyond it (return \c INFINITY to visit them all)
+	 */
+	template <typename F> void traverse(const Ray3f& _ray, F f) const {
+		if (m_nodes.empty())
+			return;
+		Ray3f ray(_ray);
+		uint32_t stack[64], stack_idx = 0, node_idx = 0;
+		float nearT, farT;
+		if (!hit(m_nodes[0].bbox, ray, nearT, farT))
+			return;
+		while (true) {
+			const Node& node = m_nodes[node_idx];
+			if (node.isLeaf()) {
+				if (hit(node.bbox, ray, nearT, farT))
+					ray.maxt = std::min(ray.maxt, f(node.media, std::max(nearT, ray.mint)));
+			} else {
+				float near0, near1;
+				bool hit0 = hit(m_nodes[node_idx + 1].bbox, ray, near0, farT);
+				bool hit1 = hit(m_nodes[node.rightChild].bbox, ray, near1, farT);
+				if (hit0 && hit1) {
+					// Visit the nearest child first, the other one may be pruned by then
+					bool leftFirst = near0 <= near1;
+					stack[stack_idx++] = leftFirst ? node.rightChild : node_idx + 1;
+					node_idx = leftFirst ? node_idx + 1 : node.rightChild;
+					continue;
+				}
+				if (hit0 || hit1) {
+					node_idx = hit0 ? node_idx + 1 : node.rightChild;
+					continue;
+				}
+			}
+			if (stack_idx == 0)
+				break;
+			node_idx = stack[--stack_idx];
+		}
+	}
+
+	std::string toString() const;
+private:
+	/// Whether \c bbox overlaps the segment of \c ray
+	static bool hit(const BoundingBox3f& bbox, const Ray3f& ray, float& nearT, float& farT) {
+		return bbox.rayIntersect(ray, nearT, farT) && farT >= ray.mint && nearT <= ray.maxt;
+	}
+
+	/// Builds the subtree over <tt>[begin, end)</tt> of \c items, returns its index
+	uint32_t build(std::vector<std::pair<BoundingBox3f, const PMedia*>>& items, size_t begin, size_t end, uint32_t depth);
+
+	/// Inner nodes store their left child right after themselves
+	struct Node {
+		BoundingBox3f bbox;
+		/// Leaf medium, \c nullptr for inner nodes
+		const PMedia* media;
+		uint32_t rightChild;
+
+		bool isLeaf() const { return media != nullptr; }
+	};
+	std::vector<Node> m_nodes;
+	uint32_t m_depth = 0;
+};
+
+NORI_NAMESPACE_END
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <nori/vector.h>
+#include <nori/simd.h>
+#include <functional>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Tileable 3D texture holding one octave of gradient noise
+ *
+ * Stores \c resolution^3 samples of a noise that repeats every \c period
+ * lattice cells along each axis. Lookups wrap around, so every octave of
+ * an fbm can be read from the same texture at its own frequency.
+ *
+ * The samples live in a cache file keyed by the noise mode and seed. Later
+ * runs memory-map it instead of baking it again.
+ */
+class NoiseTexture {
+public:
+	NoiseTexture(int resolution, int period);
+
+	~NoiseTexture();
+
+	/**
+	 * \brief Maps the cached texture, baking and writing it first if needed
+	 *
+	 * \param cacheDir
+	 *	 Directory of the cache files, relative paths are resolved against
+	 *	 the scene directory. When empty, the texture is baked in memory
+	 * \param mode
+	 *	 Noise mode identifier, part of the cache key
+	 * \param seed
+	 *	 Bits of the density seed, part of the cache key
+	 * \param noise
+	 *	 Periodic noise to bake, evaluated in lattice units over <tt>[0, period)^3</tt>
+	 */
+	void load(const std::string& cacheDir, uint32_t mode, uint32_t seed,
+		const std::function<float(const Vector3f&)>& noise);
+
+	/// Trilinearly interpolated noise at \c p, in lattice units
+	float lookup(const Vector3f& p) const {
+		int i[3], j[3];
+		float f[3];
+		for (int k = 0; k < 3; k++) {
+			float u = p[k] * m_scale;
+			float fl = std::floor(u);
+			f[k] = u - fl;
+			i[k] = (int) fl % m_res;
+			if (i[k] < 0) i[k] += m_res;
+			j[k] = i[k] + 1 == m_res ? 0 : i[k] + 1;
+		}
+		const size_t sy = m_res, sz = (size_t) m_res * m_res;
+		const float* d = m_data;
+		float d00 = lerp(f[0], d[i[2]*sz + i[1]*sy + i[0]], d[i[2]*sz + i[1]*sy + j[0]]);
+		float d10 = lerp(f[0], d[i[2]*sz + j[1]*sy + i[0]], d[i[2]*sz + j[1]*sy + j[0]]);
+		float d01 = lerp(f[0], d[j[2]*sz + i[1]*sy + i[0]], d[j[2]*sz + i[1]*sy + j[0]]);
+		float d11 = lerp(f[0], d[j[2]*sz + j[1]*sy + i[0]], d[j[2]*sz + j[1]*sy + j[0]]);
+		return lerp(f[2], lerp(f[1], d00, d10), lerp(f[1], d01, d11));
+	}
+
+	/// Packet version of \ref lookup(), one gather per lane
+	FloatP lookup(FloatP px, FloatP py, FloatP pz) const {
+		float x[FloatP::Size], y[FloatP::Size], z[FloatP::Size], r[FloatP::Size];
+		px.store(x); py.store(y); pz.store(z);
+		for (int i = 0; i < FloatP::Size; i++)
+			r[i] = lookup(Vector3f(x[i], y[i], z[i]));
+		return FloatP::load(r);
+	}
+
+	/// Lattice cells after which the noise repeats
+	int getPeriod() const { return m_period; }
+
+	/// Samples along each axis
+	int getResolution() const { return m_res; }
+
+	/// Size of the samples (mapped or resident)
+	size_t getMemoryUsage() const { return (size_t) m_res * m_res * m_res * sizeof(float); }
+
+	/// Whether the samples are memory-mapped from the cache file
+	bool isMapped() const { return m_mapping != nullptr; }
+
+	std::string toString() const;
+private:
+	/// Maps \c filename if it holds a texture with this key, returns false otherwise
+	bool map(const std::string& filename, uint64_t key);
+
+	int m_res, m_period;
+	/// Samples per lattice cell
+	float m_scale;
+	const float* m_data;
+	/// Baked samples, unused when mapped
+	std::vector<float> m_memory;
+	void* m_mapping;
+	size_t m_mappingSize;
+	std::string m_filename;
+};
+
+NORI_NAMESPACE_END
@@ -44,6 +44,7 @@ public:
 		ETest,
 		EReconstructionFilter,
 		EDensityFunction,
+		EDensityNode,
 		EClassTypeCount
 	};
 
@@ -103,6 +104,7 @@ public:
 			case EPhaseFunction:    return "phasefunction";
 			case ETest:             return "test";
 			case EDensityFunction:  return "densityFunction";
+			case EDensityNode:      return "densityNode";
 			default:                return "<unknown>";
 		}
 	}
@@ -21,6 +21,12 @@ struct PFQueryRecord {
 	PFQueryRecord(Vector3f  _wi, Vector3f  _wo) : wi(std::move(_wi)), wo(std::move(_wo)) {}
 };
 
+/// Henyey-Greenstein phase function of anisotropy \c g, for the cosine between the propagation directions
+inline float henyeyGreenstein(float g, float cosTheta) {
+	float denom = 1.0f + g * g - 2.0f * g * cosTheta;
+	return INV_FOURPI * (1.0f - g * g) / (denom * std::sqrt(denom));
+}
+
 /**
  * \brief Superclass of all phase function
  */
@@ -50,6 +56,16 @@ public:
 	 */
 	virtual Color3f eval(const PFQueryRecord &mRec) const = 0;
 
+	/**
+	 * \brief Evaluate the PF with its anisotropy scaled by \c anisotropyScale
+	 * (in [0, 1], 0 being isotropic)
+	 *
+	 * By default the PF is blended with the isotropic one.
+	 */
+	virtual Color3f eval(const PFQueryRecord &mRec, float anisotropyScale) const {
+		return anisotropyScale * eval(mRec) + (1.0f - anisotropyScale) / (4.0f * M_PI);
+	}
+
 	/**
 	 * \brief Compute the probability of sampling \c mRec.wo
 	 * (conditioned on \c mRec.wi).
@@ -66,6 +82,9 @@ public:
 	 */
 	virtual float pdf(const PFQueryRecord &mRec) const = 0;
 
+	/// Mean cosine of the scattering angle (0 for symmetric PFs)
+	virtual float getMeanCosine() const { return 0.0f; }
+
 	/**
 	 * \brief Return the type of object (i.e. Mesh/BSDF/etc.)
 	 * provided by this instance
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <nori/bbox.h>
+#include <nori/color.h>
+#include <atomic>
+#include <memory>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Spatial cache of the radiance incident on the media
+ *
+ * A hash grid over the bounds of the media whose cells hold the incident
+ * radiance projected onto spherical harmonics up to order 2. Samples are added
+ * concurrently without locks: a cell is claimed with a compare and swap of
+ * its key, and its coefficients are accumulated with atomic adds.
+ */
+class RadianceCache {
+public:
+	/**
+	 * \brief Allocate an empty cache
+	 *
+	 * \param bounds
+	 *	 Region covered by the cache, points outside of it are not stored
+	 * \param cellSize
+	 *	 Side of the cells in world units
+	 * \param capacity
+	 *	 Number of cells of the hash table, rounded up to a power of two
+	 */
+	void configure(const BoundingBox3f& bounds, float cellSize, size_t capacity);
+
+	/// Whether the cache was configured
+	bool isValid() const { return m_cells != nullptr; }
+
+	/// Add the radiance \c L arriving at \c p from direction \c w, sampled with density \c pdf
+	void add(const Point3f& p, const Vector3f& w, const Color3f& L, float pdf);
+
+	/**
+	 * \brief Radiance at \c p scattered toward \c -d by a phase function of mean cosine \c g
+	 *
+	 * \return \c false if the cell of \c p holds less than \c minSamples samples
+	 */
+	bool lookup(const Point3f& p, const Vector3f& d, float g, uint32_t minSamples, Color3f& L) const;
+
+	float getCellSize() const { return m_cellSize; }
+
+	/// Number of cells that received samples
+	size_t getUsedCells() const;
+
+	size_t getMemoryUsage() const { return m_capacity * sizeof(Cell); }
+
+	std::string toString() const;
+private:
+	/// Key of the cell containing \c p, 0 if \c p is outside the bounds
+	uint64_t key(const Point3f& p) const;
+	/// Slot holding \c key, claimed if \c insert is set. Returns -1 if not found or full
+	int64_t find(uint64_t key, bool insert) const;
+
+	/// Spherical harmonics coefficients per channel
+	static constexpr int SHCount = 9;
+
+	struct Cell {
+		std::atomic<uint64_t> key;
+		std::atomic<uint32_t> count;
+		/// Sums of the coefficients of each channel
+		std::atomic<float> sh[3 * SHCount];
+	};
+
+	BoundingBox3f m_bounds;
+	float m_cellSize = 0.0f, m_invCellSize = 0.0f;
+	size_t m_capacity = 0;
+	std::unique_ptr<Cell[]> m_cells;
+	/// Samples dropped because their probe sequence was full
+	std::atomic<size_t> m_dropped{0};
+};
+
+NORI_NAMESPACE_END
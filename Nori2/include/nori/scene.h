@@ -23,6 +23,7 @@
 
 #include <nori/accel.h>
 #include <nori/media.h>
+#include <nori/mediaaccel.h>
 
 NORI_NAMESPACE_BEGIN
 
@@ -128,20 +129,46 @@ public:
 	/// Returns whether p is visible from ref or not
 	bool isVisible(const Vector3f& ref, const Vector3f& p) const;
 
-	/// Intersects with boundaries of participating media
-	std::vector<MediaBoundaries> rayIntersectMediaBoundaries(const Ray3f& ray) const;
+	/// Return the participating media of the scene
+	const std::vector<PMedia *>& getMedia() const { return m_medias; }
 
-	/// Samples intersections with all mediums and returns the closest one
-	bool rayIntersectMediaSample(const Ray3f& ray, const std::vector<MediaBoundaries>& allMediaBoundaries, MediaIntersection& medIts) const;
+	/// Moves the animated parts of the scene to \c time (the frame number in a sequence)
+	void setTime(float time);
+
+	/// Whether the scene has any participating media
+	bool hasMedia() const { return !m_mediaAccel.empty(); }
+
+	/// Intersects with boundaries of participating media, sorted by entry distance and clipped to the segment of \c ray
+	void rayIntersectMediaBoundaries(const Ray3f& ray, MediaBoundariesList& allMediaBoundaries) const;
+
+	/// Samples intersections with all mediums and returns the closest one, drawing from the thread's \c sampler
+	bool rayIntersectMediaSample(const Ray3f& ray, const MediaBoundariesList& allMediaBoundaries, Sampler* sampler, MediaIntersection& medIts) const;
+
+	/**
+	 * \brief Samples intersections with the mediums along the ray and returns the closest one
+	 *
+	 * Random numbers are drawn from \c sampler, the one of the rendering thread.
+	 *
+	 * Visits the mediums in entry order and stops at the first one that
+	 * starts past the closest collision found so far (or past \c ray.maxt).
+	 * Collisions past \c ray.maxt are not reported.
+	 */
+	bool rayIntersectMediaSample(const Ray3f& ray, Sampler* sampler, MediaIntersection& medIts) const;
 
 	/// Returns the transmittance of traversing from x0 to xz through all mediums
-	float transmittance(const Point3f& x0, const Point3f& xz, const std::vector<MediaBoundaries>& medBounds) const;
+	float transmittance(const Point3f& x0, const Point3f& xz, const MediaBoundariesList& medBounds, Sampler* sampler) const;
 
 	/// Returns the transmittance of traversing from x0 to xz through all mediums
-	float transmittance(const Point3f& x0, const Point3f& xz) const;
+	float transmittance(const Point3f& x0, const Point3f& xz, Sampler* sampler) const;
+
+	/// Returns the transmittance from x0 to xz, a point on \c emitter, letting the mediums use their light caches
+	float transmittance(const Point3f& x0, const Point3f& xz, const Emitter* emitter, Sampler* sampler) const;
+
+	/// Returns an estimate of the optical depth from x0 to xz, a point on \c emitter, through all mediums
+	float opticalDepth(const Point3f& x0, const Point3f& xz, const Emitter* emitter, Sampler* sampler) const;
 
 	/// Returns the transmittance of traversing from x0 to xz through all mediums, taking into account that medIt is the sampled one
-	float transmittance(const Point3f& x0, const Point3f& xz, const std::vector<MediaBoundaries>& medBounds, const MediaIntersection& medIt) const;
+	float transmittance(const Point3f& x0, const Point3f& xz, const MediaBoundariesList& medBounds, const MediaIntersection& medIt, Sampler* sampler) const;
 
 	/**
 	 * \brief Inherited from \ref NoriObject::activate()
@@ -169,6 +196,7 @@ private:
 	Sampler *m_sampler = nullptr;
 	Camera *m_camera = nullptr;
 	Accel *m_accel = nullptr;
+	MediaAccel m_mediaAccel;
 
 	DiscretePDF m_pdf;
 };
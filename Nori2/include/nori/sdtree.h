@@ -0,0 +1,218 @@
+#pragma once
+
+#include <nori/bbox.h>
+#include <atomic>
+#include <vector>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Quadtree over the directions of the sphere
+ *
+ * Directions are mapped to the unit square with the area preserving
+ * cylindrical mapping. Every node stores the energy recorded in each of its
+ * four quadrants. The structure is fixed while recording, so that records
+ * from several threads are plain atomic adds.
+ */
+class DTree {
+public:
+	DTree();
+
+	/// Add \c value to the quadrants containing \c w
+	void record(const Vector3f& w, float value);
+
+	/**
+	 * \brief Sample a direction proportionally to the recorded energy times \c weight
+	 *
+	 * The product is resolved hierarchically: the energy of each quadrant is
+	 * scaled by <tt>weight(w, solidAngle)</tt> at its center direction \c w,
+	 * given the solid angle the quadrant covers. Leaves shallower than
+	 * \ref MinProductDepth are split evenly on the fly, so that a peaked
+	 * \c weight is followed even where the energy is flat.
+	 *
+	 * \param pdf
+	 *	 Solid angle density of the sampled direction
+	 */
+	template <typename F> Vector3f sample(Point2f sample, const F& weight, float& pdf) const {
+		Point2f origin(0.0f), p = sample;
+		float size = 1.0f;
+		pdf = INV_FOURPI;
+		uint32_t n = 0;
+		bool split = false;
+		for (int depth = 0; !split || depth < MinProductDepth; ++depth) {
+			float e[4], total;
+			if (!quadrantWeights(n, split, origin, size, weight, e, total))
+				break;
+			int c = pickQuadrant(e, total, p);
+			pdf *= 4.0f * e[c] / total;
+			size *= 0.5f;
+			origin += size * Point2f((float) (c & 1), (float) (c >> 1));
+			if (!split && m_nodes[n].child[c] == 0)
+				split = true;
+			else if (!split)
+				n = m_nodes[n].child[c];
+		}
+		return canonicalToDir(origin + size * p);
+	}
+
+	/// Solid angle density of \ref sample() with the same \c weight
+	template <typename F> float pdf(const Vector3f& w, const F& weight) const {
+		Point2f origin(0.0f), p = dirToCanonical(w);
+		float size = 1.0f, pdf = INV_FOURPI;
+		uint32_t n = 0;
+		bool split = false;
+		for (int depth = 0; !split || depth < MinProductDepth; ++depth) {
+			float e[4], total;
+			if (!quadrantWeights(n, split, origin, size, weight, e, total))
+				break;
+			int c = (p.x() >= 0.5f ? 1 : 0) | (p.y() >= 0.5f ? 2 : 0);
+			pdf *= 4.0f * e[c] / total;
+			if (pdf == 0.0f)
+				break;
+			p = Point2f(2.0f * p.x() - (c & 1), 2.0f * p.y() - (c >> 1));
+			size *= 0.5f;
+			origin += size * Point2f((float) (c & 1), (float) (c >> 1));
+			if (!split && m_nodes[n].child[c] == 0)
+				split = true;
+			else if (!split)
+				n = m_nodes[n].child[c];
+		}
+		return pdf;
+	}
+
+	/// Energy recorded in the whole tree
+	float getTotal() const;
+
+	/**
+	 * \brief Rebuild \c this with the energy distribution of \c tree
+	 *
+	 * The quadrants holding more than \c threshold of the total energy are
+	 * subdivided, up to \c maxDepth levels. The sums of the new tree are zero.
+	 */
+	void refine(const DTree& tree, float threshold, int maxDepth);
+
+	size_t getNodeCount() const { return m_nodes.size(); }
+	int getDepth() const { return m_depth; }
+
+	/// Depth down to which \ref sample() resolves the weight
+	static constexpr int MinProductDepth = 5;
+private:
+	/// Cylindrical mapping: x is the cosine of the polar angle, y the azimuth
+	static Point2f dirToCanonical(const Vector3f& w);
+	static Vector3f canonicalToDir(const Point2f& p);
+
+	/// Pick a quadrant with probability proportional to \c e, and rescale \c p within it
+	static int pickQuadrant(const float* e, float total, Point2f& p);
+
+	/**
+	 * \brief Energy of the quadrants of the square at \c origin, of side \c size,
+	 * times \c weight at their centers
+	 *
+	 * The energy of node \c n is used unless \c split, then it is even.
+	 * Returns \c false if the total is zero.
+	 */
+	template <typename F> bool quadrantWeights(uint32_t n, bool split, const Point2f& origin, float size,
+	                                           const F& weight, float* e, float& total) const {
+		float cosTheta[2], sinTheta[2], cosPhi[2], sinPhi[2];
+		for (int i = 0; i < 2; ++i) {
+			cosTheta[i] = 2.0f * (origin.x() + size * (0.25f + 0.5f * i)) - 1.0f;
+			sinTheta[i] = std::sqrt(std::max(0.0f, 1.0f - cosTheta[i] * cosTheta[i]));
+			float phi = 2.0f * M_PI * (origin.y() + size * (0.25f + 0.5f * i));
+			cosPhi[i] = std::cos(phi);
+			sinPhi[i] = std::sin(phi);
+		}
+		total = 0.0f;
+		float solidAngle = M_PI * size * size;
+		for (int c = 0; c < 4; ++c) {
+			int i = c & 1, j = c >> 1;
+			e[c] = (split ? 1.0f : m_nodes[n].getSum(c))
+			       * weight(Vector3f(sinTheta[i] * cosPhi[j], sinTheta[i] * sinPhi[j], cosTheta[i]), solidAngle);
+			total += e[c];
+		}
+		return total > 0.0f;
+	}
+
+	struct Node {
+		Node();
+		Node(const Node& node) { *this = node; }
+		Node& operator=(const Node& node);
+
+		float getSum(int i) const { return sum[i].load(std::memory_order_relaxed); }
+
+		std::atomic<float> sum[4];
+		/// Node of each quadrant, 0 for the leaves
+		uint32_t child[4];
+	};
+	std::vector<Node> m_nodes;
+	int m_depth;
+};
+
+/**
+ * \brief Spatial binary tree of directional quadtrees, learned online as in
+ * practical path guiding
+ *
+ * Each leaf of the spatial tree owns two \ref DTree: one that is sampled
+ * from, learned during the previous pass, and one that records the current
+ * pass. Between passes, \ref refine() splits the leaves that received many
+ * records and turns the recorded trees into the sampled ones.
+ */
+class SDTree {
+public:
+	struct Leaf {
+		Leaf() : count(0) { }
+		Leaf(const Leaf& leaf) : sampling(leaf.sampling), building(leaf.building), count(leaf.count.load()) { }
+
+		/// Record the radiance estimate \c value arriving from \c w
+		void record(const Vector3f& w, float value) {
+			building.record(w, value);
+			count.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		/// Whether the sampled tree learned anything
+		bool isTrained() const { return sampling.getTotal() > 0.0f; }
+
+		DTree sampling, building;
+		/// Records of the current pass
+		std::atomic<uint32_t> count;
+	};
+
+	/// Reset the tree to a single leaf covering \c bounds
+	void configure(const BoundingBox3f& bounds);
+
+	bool isValid() const { return !m_nodes.empty(); }
+
+	/// Leaf containing \c p, clamped to the bounds
+	Leaf& lookup(const Point3f& p) { return m_leaves[findLeaf(p)]; }
+	const Leaf& lookup(const Point3f& p) const { return m_leaves[findLeaf(p)]; }
+
+	/**
+	 * \brief Prepare the next pass
+	 *
+	 * \param spatialThreshold
+	 *	 Leaves that received more records are split in halves
+	 * \param directionalThreshold
+	 *	 Fraction of the energy above which a quadrant is subdivided
+	 * \param maxDepth
+	 *	 Maximum depth of the quadtrees
+	 */
+	void refine(uint32_t spatialThreshold, float directionalThreshold, int maxDepth);
+
+	size_t getMemoryUsage() const;
+
+	std::string toString() const;
+private:
+	uint32_t findLeaf(const Point3f& p) const;
+
+	/// Split axes alternate with the depth, children are stored next to each other
+	struct Node {
+		/// First child, 0 for leaves
+		uint32_t child;
+		uint32_t leaf;
+		uint8_t axis;
+	};
+	BoundingBox3f m_bounds;
+	std::vector<Node> m_nodes;
+	std::vector<Leaf> m_leaves;
+};
+
+NORI_NAMESPACE_END
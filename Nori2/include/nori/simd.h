@@ -0,0 +1,186 @@
+#pragma once
+
+#include <nori/common.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define NORI_SIMD_WIDTH 8
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#if defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+#define NORI_SIMD_WIDTH 4
+#else
+#include <cstring>
+#define NORI_SIMD_WIDTH 4
+#define NORI_SIMD_SCALAR
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Packet of \ref NORI_SIMD_WIDTH floats
+ *
+ * Thin wrapper over AVX2 (8 lanes) or SSE2 (4 lanes) registers, with a
+ * plain array fallback on other architectures. Comparisons return a mask
+ * packet (all bits set on true lanes) meant to be consumed by \ref select().
+ * Only the handful of operations needed by the batched noise are provided.
+ */
+struct FloatP {
+	enum { Size = NORI_SIMD_WIDTH };
+
+#if defined(__AVX2__)
+	__m256 v;
+
+	FloatP() { }
+	FloatP(__m256 _v) : v(_v) { }
+	FloatP(float f) : v(_mm256_set1_ps(f)) { }
+
+	static FloatP load(const float *p) { return _mm256_loadu_ps(p); }
+	void store(float *p) const { _mm256_storeu_ps(p, v); }
+
+	friend FloatP operator+(FloatP a, FloatP b) { return _mm256_add_ps(a.v, b.v); }
+	friend FloatP operator-(FloatP a, FloatP b) { return _mm256_sub_ps(a.v, b.v); }
+	friend FloatP operator*(FloatP a, FloatP b) { return _mm256_mul_ps(a.v, b.v); }
+	friend FloatP operator/(FloatP a, FloatP b) { return _mm256_div_ps(a.v, b.v); }
+	friend FloatP operator&(FloatP a, FloatP b) { return _mm256_and_ps(a.v, b.v); }
+	friend FloatP operator|(FloatP a, FloatP b) { return _mm256_or_ps(a.v, b.v); }
+	friend FloatP operator<(FloatP a, FloatP b)  { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+	friend FloatP operator<=(FloatP a, FloatP b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+	friend FloatP operator>(FloatP a, FloatP b)  { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+	friend FloatP operator>=(FloatP a, FloatP b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+	friend FloatP operator==(FloatP a, FloatP b) { return _mm256_cmp_ps(a.v, b.v, _CMP_EQ_OQ); }
+
+	friend FloatP min(FloatP a, FloatP b) { return _mm256_min_ps(a.v, b.v); }
+	friend FloatP max(FloatP a, FloatP b) { return _mm256_max_ps(a.v, b.v); }
+	friend FloatP sqrt(FloatP a) { return _mm256_sqrt_ps(a.v); }
+	friend FloatP floor(FloatP a) { return _mm256_floor_ps(a.v); }
+	/// Per lane \c mask ? \c a : \c b
+	friend FloatP select(FloatP mask, FloatP a, FloatP b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+	/// True if any lane of the mask is set
+	friend bool any(FloatP mask) { return _mm256_movemask_ps(mask.v) != 0; }
+#elif !defined(NORI_SIMD_SCALAR)
+	__m128 v;
+
+	FloatP() { }
+	FloatP(__m128 _v) : v(_v) { }
+	FloatP(float f) : v(_mm_set1_ps(f)) { }
+
+	static FloatP load(const float *p) { return _mm_loadu_ps(p); }
+	void store(float *p) const { _mm_storeu_ps(p, v); }
+
+	friend FloatP operator+(FloatP a, FloatP b) { return _mm_add_ps(a.v, b.v); }
+	friend FloatP operator-(FloatP a, FloatP b) { return _mm_sub_ps(a.v, b.v); }
+	friend FloatP operator*(FloatP a, FloatP b) { return _mm_mul_ps(a.v, b.v); }
+	friend FloatP operator/(FloatP a, FloatP b) { return _mm_div_ps(a.v, b.v); }
+	friend FloatP operator&(FloatP a, FloatP b) { return _mm_and_ps(a.v, b.v); }
+	friend FloatP operator|(FloatP a, FloatP b) { return _mm_or_ps(a.v, b.v); }
+	friend FloatP operator<(FloatP a, FloatP b)  { return _mm_cmplt_ps(a.v, b.v); }
+	friend FloatP operator<=(FloatP a, FloatP b) { return _mm_cmple_ps(a.v, b.v); }
+	friend FloatP operator>(FloatP a, FloatP b)  { return _mm_cmpgt_ps(a.v, b.v); }
+	friend FloatP operator>=(FloatP a, FloatP b) { return _mm_cmpge_ps(a.v, b.v); }
+	friend FloatP operator==(FloatP a, FloatP b) { return _mm_cmpeq_ps(a.v, b.v); }
+
+	friend FloatP min(FloatP a, FloatP b) { return _mm_min_ps(a.v, b.v); }
+	friend FloatP max(FloatP a, FloatP b) { return _mm_max_ps(a.v, b.v); }
+	friend FloatP sqrt(FloatP a) { return _mm_sqrt_ps(a.v); }
+	/// Per lane \c mask ? \c a : \c b
+	friend FloatP select(FloatP mask, FloatP a, FloatP b) {
+		return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v));
+	}
+	friend FloatP floor(FloatP a) {
+#if defined(__SSE4_1__)
+		return _mm_floor_ps(a.v);
+#else
+		// Truncate and correct negative non-integers (valid for |a| < 2^31)
+		FloatP t = _mm_cvtepi32_ps(_mm_cvttps_epi32(a.v));
+		return t - (FloatP(a < t) & FloatP(1.0f));
+#endif
+	}
+	/// True if any lane of the mask is set
+	friend bool any(FloatP mask) { return _mm_movemask_ps(mask.v) != 0; }
+#else
+	float v[Size];
+
+	FloatP() { }
+	FloatP(float f) { for (int i = 0; i < Size; i++) v[i] = f; }
+
+	static FloatP load(const float *p) { FloatP r; for (int i = 0; i < Size; i++) r.v[i] = p[i]; return r; }
+	void store(float *p) const { for (int i = 0; i < Size; i++) p[i] = v[i]; }
+
+	template <typename F> static FloatP map(FloatP a, FloatP b, F f) {
+		FloatP r; for (int i = 0; i < Size; i++) r.v[i] = f(a.v[i], b.v[i]); return r;
+	}
+	static float mask(bool b) { uint32_t m = b ? 0xFFFFFFFFu : 0u; float f; memcpy(&f, &m, 4); return f; }
+	static bool isSet(float f) { uint32_t m; memcpy(&m, &f, 4); return m != 0; }
+
+	friend FloatP operator+(FloatP a, FloatP b) { return map(a, b, [](float x, float y) { return x + y; }); }
+	friend FloatP operator-(FloatP a, FloatP b) { return map(a, b, [](float x, float y) { return x - y; }); }
+	friend FloatP operator*(FloatP a, FloatP b) { return map(a, b, [](float x, float y) { return x * y; }); }
+	friend FloatP operator/(FloatP a, FloatP b) { return map(a, b, [](float x, float y) { return x / y; }); }
+	friend FloatP operator&(FloatP a, FloatP b) {
+		return map(a, b, [](float x, float y) {
+			uint32_t i, j; memcpy(&i, &x, 4); memcpy(&j, &y, 4); i &= j; memcpy(&x, &i, 4); return x; });
+	}
+	friend FloatP operator|(FloatP a, FloatP b) {
+		return map(a, b, [](float x, float y) {
+			uint32_t i, j; memcpy(&i, &x, 4); memcpy(&j, &y, 4); i |= j; memcpy(&x, &i, 4); return x; });
+	}
+	friend FloatP operator<(FloatP a, FloatP b)  { return map(a, b, [](float x, float y) { return mask(x < y); }); }
+	friend FloatP operator<=(FloatP a, FloatP b) { return map(a, b, [](float x, float y) { return mask(x <= y); }); }
+	friend FloatP operator>(FloatP a, FloatP b)  { return map(a, b, [](float x, float y) { return mask(x > y); }); }
+	friend FloatP operator>=(FloatP a, FloatP b) { return map(a, b, [](float x, float y) { return mask(x >= y); }); }
+	friend FloatP operator==(FloatP a, FloatP b) { return map(a, b, [](float x, float y) { return mask(x == y); }); }
+
+	friend FloatP min(FloatP a, FloatP b) { return map(a, b, [](float x, float y) { return std::min(x, y); }); }
+	friend FloatP max(FloatP a, FloatP b) { return map(a, b, [](float x, float y) { return std::max(x, y); }); }
+	friend FloatP sqrt(FloatP a) { return map(a, a, [](float x, float) { return std::sqrt(x); }); }
+	friend FloatP floor(FloatP a) { return map(a, a, [](float x, float) { return std::floor(x); }); }
+	/// Per lane \c mask ? \c a : \c b
+	friend FloatP select(FloatP mask, FloatP a, FloatP b) {
+		FloatP r; for (int i = 0; i < Size; i++) r.v[i] = isSet(mask.v[i]) ? a.v[i] : b.v[i]; return r;
+	}
+	/// True if any lane of the mask is set
+	friend bool any(FloatP mask) {
+		for (int i = 0; i < Size; i++) if (isSet(mask.v[i])) return true;
+		return false;
+	}
+#endif
+
+	FloatP &operator+=(FloatP b) { return *this = *this + b; }
+	FloatP &operator-=(FloatP b) { return *this = *this - b; }
+	FloatP &operator*=(FloatP b) { return *this = *this * b; }
+
+	friend FloatP operator-(FloatP a) { return FloatP(0.0f) - a; }
+	friend FloatP fract(FloatP a) { return a - floor(a); }
+};
+
+/**
+ * \brief Simultaneous sine and cosine of <tt>2*pi*r</tt>
+ *
+ * Reduces \c r to the nearest quarter turn and evaluates minimax polynomials
+ * (from Cephes' sinf/cosf) on \f$[-\pi/4, \pi/4]\f$. Absolute error is
+ * around 1e-7 for the \f$[0, 1)\f$ inputs produced by the noise hashes.
+ */
+inline void sincos2PiP(FloatP r, FloatP &s, FloatP &c) {
+	FloatP q = floor(4.0f * r + 0.5f);
+	FloatP x = (r - 0.25f * q) * (2.0f * M_PI);
+	FloatP z = x * x;
+
+	FloatP sp = ((-1.9515295891e-4f * z + 8.3321608736e-3f) * z - 1.6666654611e-1f) * z * x + x;
+	FloatP cp = ((2.443315711809948e-5f * z - 1.388731625493765e-3f) * z + 4.166664568298827e-2f) * z * z
+	            - 0.5f * z + 1.0f;
+
+	// Quadrant q mod 4 decides the swap and the signs
+	FloatP qm = q - 4.0f * floor(0.25f * q);
+	FloatP swap = (qm == FloatP(1.0f)) | (qm == FloatP(3.0f));
+	FloatP negSin = qm >= FloatP(2.0f);
+	FloatP negCos = (qm == FloatP(1.0f)) | (qm == FloatP(2.0f));
+	s = select(swap, cp, sp);
+	c = select(swap, sp, cp);
+	s = select(negSin, -s, s);
+	c = select(negCos, -c, c);
+}
+
+NORI_NAMESPACE_END
@@ -0,0 +1,300 @@
+#pragma once
+
+#include <nori/bbox.h>
+#include <nori/density.h>
+#include <functional>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Dense grid of density samples with trilinear lookups
+ *
+ * Samples a procedural \ref DensityFunction once at the vertices of a
+ * regular grid spanning a bounding box, so that media can replace the
+ * full fbm evaluation by eight memory reads.
+ */
+class DensityGrid {
+public:
+	DensityGrid() : m_res(0) { }
+
+	/**
+	 * \brief Samples \c df over \c bbox in parallel
+	 *
+	 * \param resolution
+	 *	 Number of samples along the longest axis of \c bbox, the
+	 *	 other axes get the same spacing (at least 2 samples each)
+	 */
+	void bake(const DensityFunction* df, const BoundingBox3f& bbox, int resolution);
+
+	/**
+	 * \brief Samples an arbitrary function \c f over \c bbox in parallel
+	 *
+	 * Same layout as \ref bake(), for fields derived from a density (e.g.
+	 * optical depths), which are computed one vertex at a time.
+	 */
+	void build(const BoundingBox3f& bbox, int resolution, const std::function<float(const Point3f&)>& f);
+
+	/// Whether \ref bake() has been called
+	bool isBaked() const { return !m_data.empty(); }
+
+	/// Trilinearly interpolated density at \c p (clamped to the grid bounds)
+	float lookup(const Point3f& p) const {
+		Vector3f q = (p - m_bbox.min).cwiseProduct(m_invCellSize);
+		int i[3];
+		float f[3];
+		for (int k = 0; k < 3; k++) {
+			float c = clamp(q[k], 0.0f, (float) (m_res[k] - 1));
+			i[k] = std::min((int) c, m_res[k] - 2);
+			f[k] = c - (float) i[k];
+		}
+		const float* d = &m_data[index(i[0], i[1], i[2])];
+		size_t sy = m_res.x(), sz = (size_t) m_res.x() * m_res.y();
+		float d00 = lerp(f[0], d[0], d[1]);
+		float d10 = lerp(f[0], d[sy], d[sy+1]);
+		float d01 = lerp(f[0], d[sz], d[sz+1]);
+		float d11 = lerp(f[0], d[sz+sy], d[sz+sy+1]);
+		return lerp(f[2], lerp(f[1], d00, d10), lerp(f[1], d01, d11));
+	}
+
+	/// Sample at grid vertex (x, y, z)
+	float at(int x, int y, int z) const { return m_data[index(x, y, z)]; }
+
+	/// Upper bound of \ref lookup() inside \c box (max over the vertices of the covered cells)
+	float maxValue(const BoundingBox3f& box) const;
+
+	/// Lower bound of \ref lookup() inside \c box (min over the vertices of the covered cells)
+	float minValue(const BoundingBox3f& box) const;
+
+	/// Samples along each axis
+	const Vector3i& getResolution() const { return m_res; }
+
+	/// Region covered by the grid
+	const BoundingBox3f& getBoundingBox() const { return m_bbox; }
+
+	/// Memory used by the samples
+	size_t getMemoryUsage() const { return m_data.size() * sizeof(float); }
+
+	std::string toString() const;
+private:
+	size_t index(int x, int y, int z) const {
+		return ((size_t) z * m_res.y() + y) * m_res.x() + x;
+	}
+
+	/// Sets the resolution and allocates the samples of a grid spanning \c bbox
+	void setLayout(const BoundingBox3f& bbox, int resolution);
+
+	BoundingBox3f m_bbox;
+	Vector3i m_res;
+	Vector3f m_cellSize, m_invCellSize;
+	std::vector<float> m_data;
+};
+
+/**
+ * \brief Sparse two-level grid of quantized density samples
+ *
+ * The volume is split into bricks of 8^3 cells. A coarse index maps each
+ * brick to its slot in a compact array or marks it as empty. Occupied
+ * bricks store their (8+1)^3 vertex samples, apron included so lookups never
+ * leave the brick, as 8 or 16 bit integers with one scale per brick.
+ *
+ * A brick is empty when all its samples are zero, so the interpolated
+ * density is exactly zero inside it and trackers may jump over it
+ * (see \ref skipEmpty()).
+ */
+class BrickGrid {
+public:
+	enum {
+		/// Cells per brick along each axis
+		BrickCells = 8,
+		/// Vertex samples per brick along each axis
+		BrickVerts = BrickCells + 1,
+		/// Vertex samples per brick
+		BrickSize = BrickVerts * BrickVerts * BrickVerts
+	};
+
+	BrickGrid() : m_bits(16) { }
+
+	/**
+	 * \brief Samples \c df over \c bbox in parallel, keeping only non-empty bricks
+	 *
+	 * \param resolution
+	 *	 Number of cells along the longest axis of \c bbox
+	 * \param bits
+	 *	 Quantization of the stored samples, 8 or 16
+	 */
+	void bake(const DensityFunction* df, const BoundingBox3f& bbox, int resolution, int bits);
+
+	/// Whether \ref bake() has been called
+	bool isBaked() const { return !m_index.empty(); }
+
+	/// Trilinearly interpolated density at \c p (clamped to the grid bounds)
+	float lookup(const Point3f& p) const {
+		Vector3f q = (p - m_bbox.min).cwiseProduct(m_invCellSize);
+		int c[3];
+		float f[3];
+		for (int k = 0; k < 3; k++) {
+			float v = clamp(q[k], 0.0f, (float) m_cells[k]);
+			c[k] = std::min((int) v, m_cells[k] - 1);
+			f[k] = v - (float) c[k];
+		}
+		int slot = m_index[brickIndex(c[0] / BrickCells, c[1] / BrickCells, c[2] / BrickCells)];
+		if (slot < 0)
+			return 0.0f;
+
+		size_t o = (size_t) slot * BrickSize
+			+ vertexIndex(c[0] % BrickCells, c[1] % BrickCells, c[2] % BrickCells);
+		const size_t sy = BrickVerts, sz = BrickVerts * BrickVerts;
+		float d[8];
+		if (m_bits == 8) fetch(m_voxels8.data() + o, sy, sz, d);
+		else fetch(m_voxels16.data() + o, sy, sz, d);
+
+		float d00 = lerp(f[0], d[0], d[1]);
+		float d10 = lerp(f[0], d[2], d[3]);
+		float d01 = lerp(f[0], d[4], d[5]);
+		float d11 = lerp(f[0], d[6], d[7]);
+		return m_scales[slot] * lerp(f[2], lerp(f[1], d00, d10), lerp(f[1], d01, d11));
+	}
+
+	/**
+	 * \brief Advances \c t along \c ray past empty bricks
+	 *
+	 * Walks the brick index with a 3D DDA starting at <tt>ray(t)</tt> and
+	 * returns the distance where the ray enters the first occupied brick,
+	 * \c t itself if the brick at <tt>ray(t)</tt> is occupied, or \c tMax
+	 * if no occupied brick is found before it.
+	 */
+	float skipEmpty(const Ray3f& ray, float t, float tMax) const;
+
+	/// Upper bound of \ref lookup() inside \c box (max over the vertices of the covered cells)
+	float maxValue(const BoundingBox3f& box) const;
+
+	/// Lower bound of \ref lookup() inside \c box (min over the vertices of the covered cells)
+	float minValue(const BoundingBox3f& box) const;
+
+	/// Memory used by the brick index and the occupied bricks
+	size_t getMemoryUsage() const {
+		return m_index.size() * sizeof(int) + m_scales.size() * sizeof(float)
+			+ m_voxels8.size() * sizeof(uint8_t) + m_voxels16.size() * sizeof(uint16_t);
+	}
+
+	std::string toString() const;
+private:
+	template <typename T> static void fetch(const T* v, size_t sy, size_t sz, float* d) {
+		d[0] = v[0];		d[1] = v[1];
+		d[2] = v[sy];		d[3] = v[sy+1];
+		d[4] = v[sz];		d[5] = v[sz+1];
+		d[6] = v[sz+sy];	d[7] = v[sz+sy+1];
+	}
+
+	size_t brickIndex(int x, int y, int z) const {
+		return ((size_t) z * m_bricks.y() + y) * m_bricks.x() + x;
+	}
+
+	static int vertexIndex(int x, int y, int z) {
+		return (z * BrickVerts + y) * BrickVerts + x;
+	}
+
+	BoundingBox3f m_bbox;
+	/// Cells and bricks along each axis
+	Vector3i m_cells, m_bricks;
+	Vector3f m_cellSize, m_invCellSize;
+	int m_bits;
+	/// Slot of each brick in the compact arrays, -1 if empty
+	std::vector<int> m_index;
+	/// Dequantization scale of each occupied brick
+	std::vector<float> m_scales;
+	/// Quantized samples of the occupied bricks (only one of them is used)
+	std::vector<uint8_t> m_voxels8;
+	std::vector<uint16_t> m_voxels16;
+};
+
+/**
+ * \brief Coarse grid of per-cell density upper bounds
+ *
+ * Stores the maximum density of each macrocell so that delta and ratio
+ * tracking can sample free-flight distances against a local majorant
+ * instead of a single global one. Cells with a zero majorant are skipped
+ * entirely. Rays walk the cells with \ref MajorantIterator.
+ *
+ * Optionally also stores a lower bound of each cell, used as the control
+ * density of residual ratio tracking and decomposition tracking.
+ */
+class MajorantGrid {
+public:
+	/**
+	 * \brief Computes the majorant of every cell in parallel
+	 *
+	 * \param resolution
+	 *	 Number of cells along the longest axis of \c bbox
+	 * \param maxDensity
+	 *	 Returns an upper bound of the density inside a cell
+	 * \param minDensity
+	 *	 Returns a lower bound of the density inside a cell (optional)
+	 */
+	void build(const BoundingBox3f& bbox, int resolution,
+		const std::function<float(const BoundingBox3f&)>& maxDensity,
+		const std::function<float(const BoundingBox3f&)>& minDensity = nullptr);
+
+	/// Whether \ref build() has been called
+	bool isBuilt() const { return !m_data.empty(); }
+
+	/// Majorant of cell (x, y, z)
+	float at(int x, int y, int z) const { return m_data[index(x, y, z)]; }
+
+	/// Whether lower bounds were built along with the majorants
+	bool hasControls() const { return !m_controls.empty(); }
+
+	/// Lower bound of cell (x, y, z), 0 without \ref hasControls()
+	float controlAt(int x, int y, int z) const { return m_controls.empty() ? 0.0f : m_controls[index(x, y, z)]; }
+
+	/// Cells along each axis
+	const Vector3i& getResolution() const { return m_res; }
+
+	/// Average of the per-cell majorants
+	float getMean() const;
+
+	/// Memory used by the majorants and lower bounds
+	size_t getMemoryUsage() const { return (m_data.size() + m_controls.size()) * sizeof(float); }
+
+	std::string toString() const;
+private:
+	friend class MajorantIterator;
+
+	size_t index(int x, int y, int z) const {
+		return ((size_t) z * m_res.y() + y) * m_res.x() + x;
+	}
+
+	BoundingBox3f m_bbox;
+	Vector3i m_res;
+	Vector3f m_cellSize, m_invCellSize;
+	std::vector<float> m_data;
+	std::vector<float> m_controls;
+};
+
+/**
+ * \brief 3D DDA over the cells of a \ref MajorantGrid
+ *
+ * Splits <tt>[tMin, tMax]</tt> along a ray into the segments covered by each
+ * macrocell, in order. Points outside the grid are clamped to the nearest
+ * cell, so the segments always cover the whole interval.
+ */
+class MajorantIterator {
+public:
+	MajorantIterator(const MajorantGrid& grid, const Ray3f& ray, float tMin, float tMax);
+
+	/// Next segment <tt>[t0, t1]</tt> and its majorant, false once \c tMax is reached
+	bool next(float& t0, float& t1, float& majorant) {
+		float control;
+		return next(t0, t1, majorant, control);
+	}
+
+	/// Same as above, also returning the lower bound of the segment's cell
+	bool next(float& t0, float& t1, float& majorant, float& control);
+private:
+	const MajorantGrid& m_grid;
+	float m_t, m_tMax;
+	int m_cell[3], m_step[3];
+	float m_tNext[3], m_tDelta[3];
+};
+
+NORI_NAMESPACE_END
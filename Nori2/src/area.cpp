@@ -77,6 +77,17 @@ public:
 		return m_mesh->pdf(lRec.p) * (lRec.dist * lRec.dist) / (abs(lRec.n.dot(lRec.wi)));
 	}
 
+	virtual Color3f samplePhoton(Ray3f& ray, const Point2f& posSample, const Point2f& dirSample) const {
+		if (!m_mesh) throw NoriException("There is no shape attached to this Area light!");
+		Point3f p;
+		Normal3f n;
+		Point2f uv;
+		m_mesh->samplePosition(posSample, p, n, uv);
+		ray = Ray3f(p, Frame(n).toWorld(Warp::squareToCosineHemisphere(dirSample)));
+		// The cosine cancels out with the density of the direction
+		return m_radiance->eval(uv) * M_PI / m_mesh->pdf(p);
+	}
+
 	float getLuminance() const {
 		return m_luminance;
 	}
@@ -141,12 +141,13 @@ Color3f Bitmap::eval(const Point2f& uv) const {
 	float x = (1.f - uv[0]) * cols();;
 	float y = (1.f - uv[1]) * rows();
 
-	int ix = x, iy = y;
+	// Floored, so that the weights stay in [0, 1] for negative coordinates (e.g. rotated environments)
+	int ix = (int) std::floor(x), iy = (int) std::floor(y);
 	float wx = x - ix, wy = y - iy;
 
 	// Only warp suported is repeat
-	if (ix >= cols() || ix < 0) ix = ix % cols();
-	if (iy >= rows() || iy < 0) iy = iy % rows();
+	if (ix >= cols() || ix < 0) ix = (ix % cols() + cols()) % cols();
+	if (iy >= rows() || iy < 0) iy = (iy % rows() + rows()) % rows();
 
 	int ix1 = ix + 1, iy1 = iy + 1;
 	// Only warp suported is repeat
@@ -186,12 +187,13 @@ Color3f LDRBitmap::eval(const Point2f& uv) const {
 	float x = (1.f - uv[0]) * cols();;
 	float y = (1.f - uv[1]) * rows();
 
-	int ix = x, iy = y;
+	// Floored, so that the weights stay in [0, 1] for negative coordinates (e.g. rotated environments)
+	int ix = (int) std::floor(x), iy = (int) std::floor(y);
 	float wx = x - ix, wy = y - iy;
 
 	// Only warp suported is repeat
-	if (ix >= cols() || ix < 0) ix = ix % cols();
-	if (iy >= rows() || iy < 0) iy = iy % rows();
+	if (ix >= cols() || ix < 0) ix = (ix % cols() + cols()) % cols();
+	if (iy >= rows() || iy < 0) iy = (iy % rows() + rows()) % rows();
 
 	int ix1 = ix + 1, iy1 = iy + 1;
 	// Only warp suported is repeat
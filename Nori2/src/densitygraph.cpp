@@ -0,0 +1,350 @@
+#include <nori/density.h>
+#include <map>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Node of a density expression, <tt>&lt;node type="..."&gt;</tt> in the scene XML
+ *
+ * Nodes only hold their operation, parameters and children. The graph
+ * density flattens them into bytecode and never evaluates them directly.
+ * Leaves read the local position p (see \ref DensityGraph):
+ *
+ *   constant     value
+ *   coord        axis ("x", "y" or "z")
+ *   fbm          fbm(p*frequency + offset + seed)
+ *   ellipsoid    |(p - center)*scale| - radius
+ *   plane        dot(p, normal) - offset
+ *
+ * and the others combine their children:
+ *
+ *   add, mul, min, max     two or more children
+ *   sub                    first child minus the second
+ *   scale_offset           child*scale + offset
+ *   smoothstep             smoothstep(edge0, edge1, child)
+ *
+ * Inner nodes may take any value, the density is the root clamped to [0, 1].
+ */
+class DensityNode : public NoriObject {
+public:
+	enum EOp {
+		EConstant = 0,
+		ECoordX,
+		ECoordY,
+		ECoordZ,
+		EFbm,
+		EEllipsoid,
+		EPlane,
+		EAdd,
+		ESub,
+		EMul,
+		EMin,
+		EMax,
+		EScaleOffset,
+		ESmoothstep,
+		EOpCount
+	};
+
+	DensityNode(EOp op, const PropertyList &propList) : m_op(op) {
+		switch (op) {
+			case EConstant:
+				m_params = { propList.getFloat("value") };
+				break;
+			case ECoordX: {
+					std::string axis = propList.getString("axis");
+					if (axis == "x") m_op = ECoordX;
+					else if (axis == "y") m_op = ECoordY;
+					else if (axis == "z") m_op = ECoordZ;
+					else throw NoriException("coord: unknown axis \"%s\" (expected \"x\", \"y\" or \"z\")", axis);
+				}
+				break;
+			case EFbm: {
+					Vector3f offset = propList.getVector("offset", Vector3f(0.0f));
+					m_params = { propList.getFloat("frequency", 1.0f), offset.x(), offset.y(), offset.z() };
+				}
+				break;
+			case EEllipsoid: {
+					Point3f center = propList.getPoint("center", Point3f(0.0f));
+					Vector3f scale = propList.getVector("scale", Vector3f(1.0f));
+					m_params = { center.x(), center.y(), center.z(), scale.x(), scale.y(), scale.z(),
+						propList.getFloat("radius", 1.0f) };
+				}
+				break;
+			case EPlane: {
+					Vector3f normal = propList.getVector("normal", Vector3f(0.0f, 1.0f, 0.0f));
+					m_params = { normal.x(), normal.y(), normal.z(), propList.getFloat("offset", 0.0f) };
+				}
+				break;
+			case EScaleOffset:
+				m_params = { propList.getFloat("scale", 1.0f), propList.getFloat("offset", 0.0f) };
+				break;
+			case ESmoothstep:
+				m_params = { propList.getFloat("edge0"), propList.getFloat("edge1") };
+				break;
+			default:
+				break;
+		}
+	}
+
+	virtual ~DensityNode() {
+		for (auto child : m_children)
+			delete child;
+	}
+
+	void addChild(NoriObject *obj, const std::string& name = "none") override {
+		if (obj->getClassType() != EDensityNode)
+			throw NoriException("DensityNode::addChild(<%s>) is not supported!",
+				classTypeName(obj->getClassType()));
+		m_children.push_back(static_cast<DensityNode *>(obj));
+	}
+
+	void activate() override {
+		int n = (int) m_children.size();
+		bool valid;
+		switch (m_op) {
+			case EAdd: case EMul: case EMin: case EMax: valid = n >= 2; break;
+			case ESub: valid = n == 2; break;
+			case EScaleOffset: case ESmoothstep: valid = n == 1; break;
+			default: valid = n == 0; break;
+		}
+		if (!valid)
+			throw NoriException("Density node \"%s\" does not take %i children", opName(m_op), n);
+	}
+
+	EOp getOp() const { return m_op; }
+	const std::vector<float>& getParams() const { return m_params; }
+	const std::vector<DensityNode *>& getChildren() const { return m_children; }
+
+	static const char* opName(EOp op) {
+		static const char* names[EOpCount] = {
+			"constant", "coord", "coord", "coord", "fbm", "ellipsoid", "plane",
+			"add", "sub", "mul", "min", "max", "scale_offset", "smoothstep"
+		};
+		return names[op];
+	}
+
+	std::string toString() const override {
+		return tfm::format("DensityNode[op = %s, children = %i]", opName(m_op), (int) m_children.size());
+	}
+
+	EClassType getClassType() const override { return EDensityNode; }
+private:
+	EOp m_op;
+	std::vector<float> m_params;
+	std::vector<DensityNode *> m_children;
+};
+
+template <DensityNode::EOp Op> class DensityNodeOp : public DensityNode {
+public:
+	explicit DensityNodeOp(const PropertyList &propList) : DensityNode(Op, propList) { }
+};
+
+typedef DensityNodeOp<DensityNode::EConstant> ConstantNode;
+typedef DensityNodeOp<DensityNode::ECoordX> CoordNode;
+typedef DensityNodeOp<DensityNode::EFbm> FbmNode;
+typedef DensityNodeOp<DensityNode::EEllipsoid> EllipsoidNode;
+typedef DensityNodeOp<DensityNode::EPlane> PlaneNode;
+typedef DensityNodeOp<DensityNode::EAdd> AddNode;
+typedef DensityNodeOp<DensityNode::ESub> SubNode;
+typedef DensityNodeOp<DensityNode::EMul> MulNode;
+typedef DensityNodeOp<DensityNode::EMin> MinNode;
+typedef DensityNodeOp<DensityNode::EMax> MaxNode;
+typedef DensityNodeOp<DensityNode::EScaleOffset> ScaleOffsetNode;
+typedef DensityNodeOp<DensityNode::ESmoothstep> SmoothstepNode;
+
+/**
+ * \brief Density given by an expression graph in the scene XML
+ *
+ * The root \ref DensityNode child is compiled once into a flat list of
+ * instructions in SSA form: every distinct subexpression gets its own
+ * register, so repeated subtrees (e.g. the same fbm feeding two
+ * smoothsteps) are evaluated once. The same interpreter runs on floats
+ * for eval() and on SIMD packets for evalBatch(), where the dispatch cost
+ * of each instruction is shared by all lanes.
+ *
+ * Nodes see the local position <tt>p = (x - position) / scale</tt>, the
+ * same convention as \ref Cloud.
+ */
+class DensityGraph : public DensityFunction {
+public:
+	explicit DensityGraph(const PropertyList &propList) : DensityFunction(propList), m_root(nullptr) { }
+
+	virtual ~DensityGraph() {
+		delete m_root;
+	}
+
+	void addChild(NoriObject *obj, const std::string& name = "none") override {
+		if (obj->getClassType() != EDensityNode)
+			throw NoriException("DensityGraph::addChild(<%s>) is not supported!",
+				classTypeName(obj->getClassType()));
+		if (m_root)
+			throw NoriException("DensityGraph: there can only be one root node!");
+		m_root = static_cast<DensityNode *>(obj);
+	}
+
+	void activate() override {
+		if (!m_root)
+			throw NoriException("DensityGraph: missing root <node>!");
+		m_code.clear();
+		m_constants.clear();
+		std::map<std::vector<float>, int> registers;
+		m_result = compile(m_root, registers);
+	}
+
+	float eval(Vector3f p) const override {
+		p = p.cwiseQuotient(scale) - position.cwiseQuotient(scale);
+		return run(p.x(), p.y(), p.z());
+	}
+
+	void evalBatch(const float* xs, const float* ys, const float* zs, float* out, int n) const override {
+		evalPackets(xs, ys, zs, out, n, [this](FloatP x, FloatP y, FloatP z) {
+			x = x/scale.x() - position.x()/scale.x();
+			y = y/scale.y() - position.y()/scale.y();
+			z = z/scale.z() - position.z()/scale.z();
+			return run(x, y, z);
+		});
+	}
+
+	std::string toString() const override {
+		return tfm::format(
+				"DensityGraph[\n"
+				"  seed = %f,\n"
+				"  noise_mode = %s,\n"
+				"  animation = %s,\n"
+				"  instructions = %i,\n"
+				"  code = %s\n"
+				"]",
+				seed,
+				noiseModeName(),
+				animationName(),
+				(int) m_code.size(),
+				indent(disassemble(), 4));
+	}
+private:
+	enum { MaxRegisters = 64 };
+
+	/// Instruction writing register \c dst, reading registers \c a, \c b and constants from \c k
+	struct Instruction {
+		uint8_t op, dst, a, b;
+		uint32_t k;
+	};
+
+	/// Emits the code of \c node (children first), returns the register holding its value
+	int compile(const DensityNode* node, std::map<std::vector<float>, int>& registers) {
+		std::vector<int> args;
+		for (auto child : node->getChildren())
+			args.push_back(compile(child, registers));
+
+		DensityNode::EOp op = node->getOp();
+		const std::vector<float>& params = node->getParams();
+
+		/* N-ary operations become a chain of binary ones */
+		if (args.size() > 2) {
+			int acc = args[0];
+			for (size_t i = 1; i < args.size(); i++)
+				acc = emit(op, acc, args[i], params, registers);
+			return acc;
+		}
+		return emit(op, args.size() > 0 ? args[0] : 0, args.size() > 1 ? args[1] : 0, params, registers);
+	}
+
+	/// Appends an instruction unless an identical one was emitted already
+	int emit(DensityNode::EOp op, int a, int b, const std::vector<float>& params,
+			std::map<std::vector<float>, int>& registers) {
+		std::vector<float> key = { (float) op, (float) a, (float) b };
+		key.insert(key.end(), params.begin(), params.end());
+		auto it = registers.find(key);
+		if (it != registers.end())
+			return it->second;
+
+		if ((int) m_code.size() == MaxRegisters)
+			throw NoriException("DensityGraph: the expression has more than %i distinct nodes", (int) MaxRegisters);
+
+		Instruction ins;
+		ins.op = (uint8_t) op;
+		ins.dst = (uint8_t) m_code.size();
+		ins.a = (uint8_t) a;
+		ins.b = (uint8_t) b;
+		ins.k = (uint32_t) m_constants.size();
+		m_constants.insert(m_constants.end(), params.begin(), params.end());
+		m_code.push_back(ins);
+		registers[key] = ins.dst;
+		return ins.dst;
+	}
+
+	float fbmAt(float x, float y, float z) const { return fbm(Vector3f(x, y, z)); }
+	FloatP fbmAt(FloatP x, FloatP y, FloatP z) const { return fbm(x, y, z); }
+
+	/// Bytecode interpreter, T is float or FloatP
+	template <typename T> T run(T x, T y, T z) const {
+		using std::min;
+		using std::max;
+		using std::sqrt;
+		T r[MaxRegisters];
+		for (const Instruction& ins : m_code) {
+			const float* k = m_constants.data() + ins.k;
+			T& dst = r[ins.dst];
+			switch (ins.op) {
+				case DensityNode::EConstant: dst = T(k[0]); break;
+				case DensityNode::ECoordX: dst = x; break;
+				case DensityNode::ECoordY: dst = y; break;
+				case DensityNode::ECoordZ: dst = z; break;
+				case DensityNode::EFbm:
+					dst = fbmAt(x*k[0] + (k[1] + seed), y*k[0] + (k[2] + seed), z*k[0] + (k[3] + seed));
+					break;
+				case DensityNode::EEllipsoid: {
+						T dx = (x - k[0])*k[3], dy = (y - k[1])*k[4], dz = (z - k[2])*k[5];
+						dst = sqrt(dx*dx + dy*dy + dz*dz) - k[6];
+					}
+					break;
+				case DensityNode::EPlane: dst = x*k[0] + y*k[1] + z*k[2] - k[3]; break;
+				case DensityNode::EAdd: dst = r[ins.a] + r[ins.b]; break;
+				case DensityNode::ESub: dst = r[ins.a] - r[ins.b]; break;
+				case DensityNode::EMul: dst = r[ins.a] * r[ins.b]; break;
+				case DensityNode::EMin: dst = min(r[ins.a], r[ins.b]); break;
+				case DensityNode::EMax: dst = max(r[ins.a], r[ins.b]); break;
+				case DensityNode::EScaleOffset: dst = r[ins.a]*k[0] + k[1]; break;
+				case DensityNode::ESmoothstep: dst = smoothstep(k[0], k[1], r[ins.a]); break;
+			}
+		}
+		// The media take densities in [0, 1], their majorants rely on it
+		return min(max(r[m_result], T(0.0f)), T(1.0f));
+	}
+
+	std::string disassemble() const {
+		std::string result;
+		for (const Instruction& ins : m_code) {
+			DensityNode::EOp op = (DensityNode::EOp) ins.op;
+			result += tfm::format("\n  r%i = %s", (int) ins.dst, DensityNode::opName(op));
+			if (op == DensityNode::EConstant)
+				result += tfm::format(" %f", m_constants[ins.k]);
+			if (op == DensityNode::ECoordX || op == DensityNode::ECoordY || op == DensityNode::ECoordZ)
+				result += op == DensityNode::ECoordX ? " x" : (op == DensityNode::ECoordY ? " y" : " z");
+			if (op >= DensityNode::EAdd)
+				result += tfm::format(" r%i", (int) ins.a);
+			if (op >= DensityNode::EAdd && op <= DensityNode::EMax)
+				result += tfm::format(" r%i", (int) ins.b);
+		}
+		return result;
+	}
+
+	DensityNode* m_root;
+	std::vector<Instruction> m_code;
+	std::vector<float> m_constants;
+	int m_result;
+};
+
+NORI_REGISTER_CLASS(ConstantNode, "constant");
+NORI_REGISTER_CLASS(CoordNode, "coord");
+NORI_REGISTER_CLASS(FbmNode, "fbm");
+NORI_REGISTER_CLASS(EllipsoidNode, "ellipsoid");
+NORI_REGISTER_CLASS(PlaneNode, "plane");
+NORI_REGISTER_CLASS(AddNode, "add");
+NORI_REGISTER_CLASS(SubNode, "sub");
+NORI_REGISTER_CLASS(MulNode, "mul");
+NORI_REGISTER_CLASS(MinNode, "min");
+NORI_REGISTER_CLASS(MaxNode, "max");
+NORI_REGISTER_CLASS(ScaleOffsetNode, "scale_offset");
+NORI_REGISTER_CLASS(SmoothstepNode, "smoothstep");
+NORI_REGISTER_CLASS(DensityGraph, "graph");
+NORI_NAMESPACE_END
@@ -0,0 +1,124 @@
+#include <nori/density.h>
+#include <nori/timer.h>
+#include <nori/warp.h>
+#include <pcg32.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * Microbenchmark for density functions
+ *
+ * Evaluates every child density at the same random points, once through
+ * the scalar \ref DensityFunction::eval() and once through
+ * \ref DensityFunction::evalBatch(), and reports evaluations per second
+ * together with the largest difference between both paths. Also checks
+ * \ref DensityFunction::emptyDistance() by evaluating the density at a
+ * random point inside each ball it claims to be empty.
+ */
+class DensityBenchmark : public NoriObject {
+public:
+	DensityBenchmark(const PropertyList &propList) {
+		/* Number of points evaluated per density (default: 1M) */
+		m_sampleCount = propList.getInteger("sampleCount", 1000000);
+		/* Points are drawn uniformly inside this box */
+		m_min = propList.getPoint("min", Point3f(-10.0f));
+		m_max = propList.getPoint("max", Point3f(10.0f));
+		/* Batch size handed to evalBatch() */
+		m_batchSize = propList.getInteger("batchSize", 256);
+	}
+
+	virtual ~DensityBenchmark() {
+		for (auto df : m_densities)
+			delete df;
+	}
+
+	void addChild(NoriObject *obj, const std::string& name = "none") {
+		switch (obj->getClassType()) {
+			case EDensityFunction:
+				m_densities.push_back(static_cast<DensityFunction *>(obj));
+				break;
+
+			default:
+				throw NoriException("DensityBenchmark::addChild(<%s>) is not supported!",
+					classTypeName(obj->getClassType()));
+		}
+	}
+
+	void activate() {
+		pcg32 random;
+		std::vector<float> xs(m_sampleCount), ys(m_sampleCount), zs(m_sampleCount);
+		for (int i = 0; i < m_sampleCount; ++i) {
+			xs[i] = m_min.x() + random.nextFloat() * (m_max.x() - m_min.x());
+			ys[i] = m_min.y() + random.nextFloat() * (m_max.y() - m_min.y());
+			zs[i] = m_min.z() + random.nextFloat() * (m_max.z() - m_min.z());
+		}
+		std::vector<float> scalar(m_sampleCount), batch(m_sampleCount);
+
+		cout << "SIMD width: " << FloatP::Size << " lanes" << endl;
+		for (auto df : m_densities) {
+			cout << "------------------------------------------------------" << endl;
+			cout << "Benchmarking: " << df->toString() << endl;
+
+			Timer timer;
+			for (int i = 0; i < m_sampleCount; ++i)
+				scalar[i] = df->eval(Vector3f(xs[i], ys[i], zs[i]));
+			double scalarTime = timer.lap();
+
+			for (int i = 0; i < m_sampleCount; i += m_batchSize) {
+				int n = std::min(m_batchSize, m_sampleCount - i);
+				df->evalBatch(&xs[i], &ys[i], &zs[i], &batch[i], n);
+			}
+			double batchTime = timer.lap();
+
+			float maxError = 0.0f;
+			for (int i = 0; i < m_sampleCount; ++i)
+				maxError = std::max(maxError, std::abs(scalar[i] - batch[i]));
+
+			cout << tfm::format("  eval():      %s (%.2f M evals/s)",
+				timeString(scalarTime, true), evalsPerSecond(scalarTime)) << endl;
+			cout << tfm::format("  evalBatch(): %s (%.2f M evals/s, %.1fx)",
+				timeString(batchTime, true), evalsPerSecond(batchTime),
+				scalarTime / std::max(batchTime, 1.0)) << endl;
+			cout << "  max |eval - evalBatch| = " << maxError << endl;
+
+			int emptyCount = 0, emptyViolations = 0;
+			for (int i = 0; i < m_sampleCount; ++i) {
+				Point3f p(xs[i], ys[i], zs[i]);
+				float dist = df->emptyDistance(p);
+				if (dist <= 0.0f)
+					continue;
+				emptyCount++;
+				Vector3f dir = Warp::squareToUniformSphere(Point2f(random.nextFloat(), random.nextFloat()));
+				if (df->eval(p + dir * dist * random.nextFloat()) != 0.0f)
+					emptyViolations++;
+			}
+			cout << tfm::format("  emptyDistance(): %.1f%% of the points proven empty, %i violations",
+				100.0f * emptyCount / m_sampleCount, emptyViolations) << endl;
+		}
+	}
+
+	std::string toString() const {
+		return tfm::format(
+			"DensityBenchmark[\n"
+			"  sampleCount = %i,\n"
+			"  batchSize = %i\n"
+			"]",
+			m_sampleCount,
+			m_batchSize
+		);
+	}
+
+	EClassType getClassType() const { return ETest; }
+private:
+	float evalsPerSecond(double ms) const {
+		return (float) (m_sampleCount / std::max(ms, 1.0) / 1000.0);
+	}
+
+	std::vector<DensityFunction *> m_densities;
+	Point3f m_min, m_max;
+	int m_sampleCount;
+	int m_batchSize;
+};
+
+NORI_REGISTER_CLASS(DensityBenchmark, "density_benchmark");
+NORI_NAMESPACE_END
@@ -90,7 +90,8 @@ public:
 		lRec.wi = Warp::squareToUniformSphere(sample);
 		lRec.n = -lRec.wi;
 		lRec.dist = INFINITY;
-		lRec.p = lRec.wi * lRec.dist + lRec.ref;
+		// A far but finite point, so that the shadow rays toward it keep a direction (wi * INFINITY has NaNs)
+		lRec.p = lRec.ref + lRec.wi * 1e6f;
 		lRec.pdf = pdf(lRec);
 
 		float phi = atan2(lRec.wi[2], lRec.wi[0]);
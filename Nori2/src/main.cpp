@@ -66,7 +66,7 @@ static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block)
 	}
 }
 
-static void render(Scene* scene, const std::string& filename, bool nogui) {
+static void render(Scene* scene, const std::string& outputName, bool nogui) {
 	const Camera* camera = scene->getCamera();
 	Vector2i outputSize = camera->getOutputSize();
 	scene->getIntegrator()->preprocess(scene);
@@ -128,6 +128,12 @@ static void render(Scene* scene, const std::string& filename, bool nogui) {
 		// map(range);
 
 		cout << "done. (took " << timer.elapsedString() << ")" << endl;
+
+		for (const PMedia* media : scene->getMedia()) {
+			std::string stats = media->getStatistics();
+			if (!stats.empty())
+				cout << stats << endl;
+		}
 	});
 
 	if (!nogui)
@@ -150,12 +156,6 @@ static void render(Scene* scene, const std::string& filename, bool nogui) {
 	   a properly normalized bitmap */
 	std::unique_ptr<Bitmap> bitmap(result.toBitmap());
 
-	/* Determine the filename of the output bitmap */
-	std::string outputName = filename;
-	size_t lastdot = outputName.find_last_of(".");
-	if (lastdot != std::string::npos)
-		outputName.erase(lastdot, std::string::npos);
-
 	/* Save using the OpenEXR format */
 	bitmap->saveEXR(outputName);
 
@@ -165,12 +165,14 @@ static void render(Scene* scene, const std::string& filename, bool nogui) {
 
 int main(int argc, char **argv) {
 	if (argc < 2) {
-		cerr << "Syntax: " << argv[0] << " <scene.xml>" << endl;
+		cerr << "Syntax: " << argv[0] << " [--threads n] [--nogui] [--frames first:last] <scene.xml>" << endl;
 		return -1;
 	}
 
 	bool nogui = false;
 	std::string sceneName = "";
+	/* Frame range of a sequence (inclusive), the scene is rendered once if empty */
+	int firstFrame = 0, lastFrame = -1;
 
 	for (int i = 1; i < argc; ++i) {
 		std::string token(argv[i]);
@@ -190,6 +192,13 @@ int main(int argc, char **argv) {
 		}
 		else if(token == "--nogui" || token == "-b")
 			nogui = true;
+		else if (token == "-f" || token == "--frames") {
+			if (i+1 >= argc || sscanf(argv[i+1], "%d:%d", &firstFrame, &lastFrame) != 2 || lastFrame < firstFrame) {
+				cerr << "\"--frames\" argument expects a range \"first:last\" with first <= last following it." << endl;
+				return -1;
+			}
+			i++;
+		}
 		else
 		{
 			filesystem::path path(argv[i]);
@@ -232,11 +241,34 @@ int main(int argc, char **argv) {
 
 	if (sceneName != "") {
 		try {
-			std::unique_ptr<NoriObject> root(loadFromXML(argv[1]));
+			std::unique_ptr<NoriObject> root(loadFromXML(sceneName));
+
+			/* Determine the filename of the output bitmap */
+			std::string outputName = sceneName;
+			size_t lastdot = outputName.find_last_of(".");
+			if (lastdot != std::string::npos)
+				outputName.erase(lastdot, std::string::npos);
 
 			/* When the XML root object is a scene, start rendering it .. */
-			if (root->getClassType() == NoriObject::EScene)
-				render(static_cast<Scene*>(root.get()), argv[1], nogui);
+			if (root->getClassType() == NoriObject::EScene) {
+				Scene* scene = static_cast<Scene*>(root.get());
+				if (lastFrame < firstFrame) {
+					render(scene, outputName, nogui);
+				}
+				else {
+					/* .. or a sequence of it, keeping the scene, its acceleration
+					   structures and noise textures loaded between frames. Only
+					   animated media are updated (and rebaked) at each frame */
+					if (!nogui)
+						cout << "Rendering a sequence, the preview window is disabled." << endl;
+					for (int frame = firstFrame; frame <= lastFrame; ++frame) {
+						cout << "Frame " << frame << " (" << frame - firstFrame + 1 << "/"
+							<< lastFrame - firstFrame + 1 << ")" << endl;
+						scene->setTime((float) frame);
+						render(scene, tfm::format("%s_%04i", outputName, frame), true);
+					}
+				}
+			}
 		}
 		catch (const std::exception& e) {
 			cerr << "[FATAL ERROR]: " << e.what() << endl;
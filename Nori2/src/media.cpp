@@ -6,16 +6,14 @@
 #include <nori/media.h>
 #include <nori/phasefunction.h>
 #include <nori/sampler.h>
+#include <nori/volume.h>
+#include <nori/densities.h>
+#include <nori/emitter.h>
+#include <nori/timer.h>
+#include <tbb/enumerable_thread_specific.h>
 
 NORI_NAMESPACE_BEGIN
 
-float distanceTravelledInMedia(float t, const MediaBoundaries& medBound) {
-	if (medBound.wasInside) return std::min(t, medBound.tOut);
-	else if (t > medBound.tBoundary) return std::min(medBound.tOut - medBound.tBoundary, t - medBound.tBoundary);
-	else return 0.0f;
-}
-
-
 PMedia::PMedia() : m_accel(new Accel), m_densityFunction(nullptr) {}
 
 PMedia::~PMedia() {
@@ -32,24 +30,38 @@ std::ostream& operator<<(std::ostream& os, const MediaCoeffs& m) {
 
 
 bool PMedia::rayIntersectBoundaries(const Ray3f& ray, MediaBoundaries& mediaBoundaries) const {
-	Intersection its;
-	if (!m_accel->rayIntersect(ray, its, false)) return false;
-
-	float cos = its.geoFrame.n.dot(ray.d);
-	bool inside = cos >= 0;
-	if (inside) {
-		mediaBoundaries = MediaBoundaries(this, true, 0.0f, true, its.t);
-	} else {
-		// little march as sanity check
-		const float rayMarchTrick = 0.0001f;
-		Ray3f insideRay(its.p + rayMarchTrick*ray.d, ray.d);
-		Intersection itsInside;
-		bool intersected = m_accel->rayIntersect(insideRay, itsInside, false);
-		// Sometimes it has some errors at corners...
-		if (!intersected) return false;
-		mediaBoundaries = MediaBoundaries(this, true, its.t, false,  its.t + itsInside.t - rayMarchTrick);
-	}
-	return true;
+	RayCrossing crossings[MediaBoundaries::MaxCrossings];
+	mediaBoundaries = MediaBoundaries(this);
+	Ray3f batch(ray);
+	// Nesting depth inside the mesh, the ray starts inside if it first leaves it
+	int depth = -1;
+	float tEnter = 0.0f;
+	RayCrossing prev = { -INFINITY, false };
+	while (true) {
+		int count = m_accel->rayIntersectAll(batch, crossings, MediaBoundaries::MaxCrossings);
+		if (count == 0) break;
+		if (depth < 0) {
+			depth = crossings[0].entering ? 0 : 1;
+			mediaBoundaries.wasInside = depth > 0;
+		}
+		for (int i = 0; i < count; i++) {
+			const RayCrossing& c = crossings[i];
+			// A ray through an edge or a vertex hits every triangle sharing it, count it once
+			bool duplicate = c.entering == prev.entering && c.t - prev.t <= Epsilon * std::max(1.0f, c.t);
+			prev = c;
+			if (duplicate)
+				continue;
+			if (c.entering) {
+				if (depth++ == 0) tEnter = c.t;
+			} else if (depth > 0 && --depth == 0) {
+				mediaBoundaries.addInterval(tEnter, c.t);
+			}
+		}
+		// A full buffer may have left farther crossings out, the traversal resumes past the last one
+		if (count < MediaBoundaries::MaxCrossings) break;
+		batch.mint = std::nextafter(crossings[count - 1].t, INFINITY);
+	}
+	return mediaBoundaries.intersected;
 }
 
 void PMedia::addChild(NoriObject *obj, const std::string& name) {
@@ -100,29 +112,21 @@ public:
 
 	bool rayIntersectSample(const Ray3f& ray, const MediaBoundaries& boundaries, Sampler* sampler, MediaIntersection& medIts) const override {
 		if (!boundaries.intersected) return false;
-		else {
-			float t = this->sampleDist(sampler->next1D());
-			if (boundaries.wasInside) {
-				if (t > boundaries.tOut) return false;
-				else {
-					Point3f pt = ray.o + ray.d*t;
-					MediaCoeffs mediaCoeffs = this->getMediaCoeffs(pt);
-					// mu_max = mu_t in homogeneous
-					medIts = MediaIntersection(pt, t, this, boundaries, mediaCoeffs.mu_max);
-					return true;
-				}
-			} else {
-				if (t > boundaries.tOut) return false;
-				else {
-					t += boundaries.tBoundary;
-					Point3f pt = ray.o + ray.d*t;
-					MediaCoeffs mediaCoeffs = this->getMediaCoeffs(pt);
-					// mu_max = mu_t in homogeneous
-					medIts = MediaIntersection(pt, t, this, boundaries, mediaCoeffs.mu_max);
-					return true;
-				}
+		// Distance to travel inside the media, spent interval by interval
+		float dist = this->sampleDist(sampler->next1D());
+		for (int i = 0; i < boundaries.intervalCount; i++) {
+			float length = boundaries.tExit(i) - boundaries.tEnter(i);
+			if (dist < length) {
+				float t = boundaries.tEnter(i) + dist;
+				Point3f pt = ray.o + ray.d*t;
+				MediaCoeffs mediaCoeffs = this->getMediaCoeffs(pt);
+				// mu_max = mu_t in homogeneous
+				medIts = MediaIntersection(pt, t, this, boundaries, mediaCoeffs.mu_max);
+				return true;
 			}
+			dist -= length;
 		}
+		return false;
 	}
 
 	MediaCoeffs getMediaCoeffs(const Point3f& p) const override {
@@ -131,10 +135,16 @@ public:
 
 	float transmittance(const Point3f& x0, const Point3f& xz, const MediaBoundaries& medBound, Sampler* sampler) const override {
 		float t = (xz-x0).norm();
-		float dist = distanceTravelledInMedia(t, medBound);
+		float dist = medBound.lengthInside(t);
 		return exp(-mu_max * dist);
 	}
 
+	float opticalDepth(const Point3f& x0, const Point3f& xz, const Emitter* light, const MediaBoundaries& medBound, Sampler* sampler) const override {
+		return mu_max * medBound.lengthInside((xz - x0).norm());
+	}
+
+	bool isHomogeneous() const override { return true; }
+
 	std::string toString() const override {
 		std::string pf = m_phaseFunction->toString();
 		return tfm::format(
@@ -163,6 +173,214 @@ private:
 	float sigma_a, sigma_s;
 	/// \delta t for marching through media
 	float dt;
+	/// Samples along the longest axis of the baked density grid (0 = evaluate procedurally)
+	int bakeResolution;
+	/// Layout of the baked density: "dense" floats or "sparse" quantized bricks
+	std::string bakeGrid;
+	/// Quantization of the sparse bricks (8 or 16 bits)
+	int bakeBits;
+	/// Density baked over the bounding box of the mesh (only one of them is used)
+	DensityGrid m_grid;
+	BrickGrid m_bricks;
+	/// Macrocells along the longest axis of the majorant grid (0 = single global majorant)
+	int majorantResolution;
+	/// Whether the majorants of a procedural density are estimated from samples, which may underestimate it
+	bool sampledMajorants;
+	/// Relative safety margin of the sampled majorants
+	float majorantMargin;
+	/// Per-macrocell density bounds, scaled by mu_max during tracking
+	MajorantGrid m_majorants;
+	/// Transmittance by residual ratio tracking instead of ratio tracking
+	bool residualTracking;
+	/// Distance sampling by decomposition tracking instead of delta tracking
+	bool decompositionTracking;
+	/// Control density of the residual trackers without a majorant grid, at most the smallest baked density (with one, each cell uses its lower bound)
+	float controlDensity;
+
+	/// Estimator used by transmittance()
+	enum ETransmittanceEstimator {
+		ERatioTracking = 0,
+		ETrackLength,
+		ERatioRoulette,
+		EPowerSeries
+	};
+	ETransmittanceEstimator trEstimator;
+	/// Transmittance below which ratio tracking plays Russian roulette (0 = never)
+	float rrThreshold;
+	/// Lookups of each ray march of the power-series estimator, per unit of majorant optical depth
+	float powerSeriesLookups;
+	/// Whether one transmittance call (and controlled light transmittance) out of VarianceSamplingRate is estimated twice to measure the variance
+	bool measureVariance;
+	enum { VarianceSamplingRate = 32 };
+	/// Vertices along the longest axis of the light transmittance grids (0 = track toward the lights)
+	int shadowResolution;
+	/// Whether NEE uses the cached transmittance as the control of an unbiased estimate, or as is
+	bool shadowControl;
+
+	/// Optical depth toward a point light, at the vertices of a grid over the bounds
+	struct ShadowGrid {
+		const Emitter* light;
+		Point3f position;
+		DensityGrid depth;
+	};
+	std::vector<ShadowGrid> m_shadowGrids;
+
+	/// Tracking counters of a thread, merged by getStatistics()
+	struct TrackingStats {
+		uint64_t deltaCalls = 0, deltaLookups = 0, nullCollisions = 0, majorantViolations = 0;
+		uint64_t controlCollisions = 0, controlViolations = 0;
+		uint64_t trCalls = 0, trLookups = 0, trVarianceSamples = 0;
+		double trVariance = 0.0;
+		uint64_t shadowCached = 0, shadowControlled = 0, shadowLookups = 0, shadowVarianceSamples = 0;
+		double shadowVariance = 0.0;
+
+		TrackingStats& operator+=(const TrackingStats& s) {
+			deltaCalls += s.deltaCalls;
+			deltaLookups += s.deltaLookups;
+			nullCollisions += s.nullCollisions;
+			majorantViolations += s.majorantViolations;
+			controlCollisions += s.controlCollisions;
+			controlViolations += s.controlViolations;
+			trCalls += s.trCalls;
+			trLookups += s.trLookups;
+			trVarianceSamples += s.trVarianceSamples;
+			trVariance += s.trVariance;
+			shadowCached += s.shadowCached;
+			shadowControlled += s.shadowControlled;
+			shadowLookups += s.shadowLookups;
+			shadowVarianceSamples += s.shadowVarianceSamples;
+			shadowVariance += s.shadowVariance;
+			return *this;
+		}
+	};
+	/// Written by their own thread only, so that the trackers share no cache line
+	mutable tbb::enumerable_thread_specific<TrackingStats> m_stats;
+
+	/// Concrete type of the density function, resolved once in activate()
+	enum EDensityKind {
+		EGenericDensity = 0,
+		ECloudDensity,
+		ECloudSmallDensity,
+		ESkyDensity
+	};
+	EDensityKind m_densityKind;
+	/// Whether the tracking loops call the density through its concrete type
+	bool devirtualize;
+
+	/**
+	 * \brief Calls <tt>f(df)</tt> with the density function cast to its concrete type
+	 *
+	 * The tracking loops are templates over the density type, so resolving it
+	 * once per query replaces two virtual calls per tentative collision
+	 * (getMediaCoeffs() and DensityFunction::eval()) by inlined code.
+	 */
+	template <typename F> auto dispatchDensity(F f) const -> decltype(f(m_densityFunction)) {
+		switch (m_densityKind) {
+			case ECloudDensity: return f(static_cast<const Cloud*>(m_densityFunction));
+			case ECloudSmallDensity: return f(static_cast<const CloudSmall*>(m_densityFunction));
+			case ESkyDensity: return f(static_cast<const Sky*>(m_densityFunction));
+			default: return f(static_cast<const DensityFunction*>(m_densityFunction));
+		}
+	}
+
+	template <typename Density> float density(const Density* df, const Point3f& p) const {
+		if (m_bricks.isBaked()) return m_bricks.lookup(p);
+		if (m_grid.isBaked()) return m_grid.lookup(p);
+		return df->eval(p);
+	}
+
+	/// Jumps over empty bricks of the sparse grid, a no-op otherwise
+	float skipEmpty(const Ray3f& ray, float t, float tMax) const {
+		return m_bricks.isBaked() ? m_bricks.skipEmpty(ray, t, tMax) : t;
+	}
+
+	/**
+	 * \brief Leaps over space the procedural density proves empty
+	 *
+	 * Sphere traces \ref DensityFunction::emptyDistance() from <tt>ray(t)</tt>,
+	 * stopping once the leaps get shorter than a fraction of the mean free
+	 * path. Baked densities interpolate across cells, so the procedural bound
+	 * does not apply to them and \c t is returned as is.
+	 */
+	template <typename Density> float leapEmpty(const Density* df, const Ray3f& ray, float t, float tMax) const {
+		if (m_grid.isBaked() || m_bricks.isBaked()) return t;
+		const float minLeap = 0.05f / mu_max;
+		for (int i = 0; i < 32 && t < tMax; i++) {
+			float dist = df->emptyDistance(ray(t));
+			if (dist < minLeap) break;
+			t += dist;
+		}
+		return std::min(t, tMax);
+	}
+
+	/**
+	 * \brief Draws tentative collisions along <tt>[tMin, tMax]</tt>
+	 *
+	 * Free-flight distances are sampled against the majorant of the current
+	 * macrocell (or the global \c mu_max when there is no majorant grid).
+	 * Provably empty stretches get a zero majorant, which is unbiased since
+	 * the flight restarts memorylessly on the other side.
+	 * Calls <tt>collide(t, majorant)</tt> at each tentative collision until it
+	 * returns true, and returns false if \c tMax is reached first.
+	 */
+	template <typename Density, typename Collide>
+	bool track(const Density* df, const Ray3f& ray, float tMin, float tMax, Sampler* sampler, Collide collide) const {
+		if (!m_majorants.isBuilt()) {
+			float t = tMin;
+			while (true) {
+				// Null collisions only in empty bricks, restart the flight past them
+				t = skipEmpty(ray, t, tMax);
+				t = leapEmpty(df, ray, t, tMax);
+				t += sampleDist(sampler->next1D());
+				if (t > tMax) return false;
+				if (collide(t, mu_max)) return true;
+			}
+		}
+
+		// The optical depth left to travel carries over between macrocells
+		MajorantIterator it(m_majorants, ray, tMin, tMax);
+		float t0, t1, majorant;
+		float tau = -log(1 - sampler->next1D());
+		while (it.next(t0, t1, majorant)) {
+			majorant *= mu_max;
+			if (majorant <= 0.0f) continue;
+			while (true) {
+				t0 = leapEmpty(df, ray, t0, t1);
+				float t = t0 + tau / majorant;
+				if (t >= t1) {
+					tau -= (t1 - t0) * majorant;
+					break;
+				}
+				if (collide(t, majorant)) return true;
+				t0 = t;
+				tau = -log(1 - sampler->next1D());
+			}
+		}
+		return false;
+	}
+
+	/**
+	 * \brief Calls <tt>f(t0, t1, majorant, control)</tt> for the segments of
+	 * <tt>[tMin, tMax]</tt> until it returns true
+	 *
+	 * The segments are the macrocells crossed by the ray, or the whole interval
+	 * with the global majorant and \c controlDensity when there is no majorant
+	 * grid. Both coefficients are extinctions (scaled by \c mu_max).
+	 */
+	template <typename F> bool forEachSegment(const Ray3f& ray, float tMin, float tMax, F f) const {
+		if (!m_majorants.isBuilt())
+			return f(tMin, tMax, mu_max, controlDensity * mu_max);
+		MajorantIterator it(m_majorants, ray, tMin, tMax);
+		float t0, t1, majorant, control;
+		while (it.next(t0, t1, majorant, control))
+			if (f(t0, t1, majorant * mu_max, control * mu_max)) return true;
+		return false;
+	}
+
+	/// Skips space with zero density, only valid where the control extinction is zero as well
+	template <typename Density> float skipZero(const Density* df, const Ray3f& ray, float t, float tMax) const {
+		return leapEmpty(df, ray, skipEmpty(ray, t, tMax), tMax);
+	}
 
 public:
 	explicit HeterogeneousMedia(const PropertyList &propList) {
@@ -170,61 +388,604 @@ public:
 		sigma_a = propList.getFloat("sigma_a", 0.0f);
 		sigma_s = propList.getFloat("sigma_s", 0.0f);
 		dt = propList.getFloat("delta_t", 0.0f);
+		bakeResolution = propList.getInteger("bake_resolution", 0);
+		bakeGrid = propList.getString("bake_grid", "dense");
+		bakeBits = propList.getInteger("bake_bits", 16);
+		majorantResolution = propList.getInteger("majorant_resolution", 0);
+		std::string majorantBound = propList.getString("majorant_bound", "conservative");
+		if (majorantBound != "conservative" && majorantBound != "sampled")
+			throw NoriException("HeterogeneousMedia: unknown majorant_bound \"%s\" (expected \"conservative\" or \"sampled\")", majorantBound);
+		sampledMajorants = majorantBound == "sampled";
+		majorantMargin = propList.getFloat("majorant_margin", 0.1f);
+		devirtualize = propList.getBoolean("devirtualize", true);
+		residualTracking = propList.getBoolean("residual_tracking", false);
+		decompositionTracking = propList.getBoolean("decomposition_tracking", false);
+		controlDensity = propList.getFloat("control_density", 0.0f);
+		if (controlDensity < 0.0f || controlDensity > 1.0f)
+			throw NoriException("HeterogeneousMedia: control_density must be in [0, 1] (got %f)", controlDensity);
+		std::string estimator = propList.getString("transmittance_estimator", "ratio");
+		if (estimator == "ratio") trEstimator = ERatioTracking;
+		else if (estimator == "track_length") trEstimator = ETrackLength;
+		else if (estimator == "ratio_rr") trEstimator = ERatioRoulette;
+		else if (estimator == "power_series") trEstimator = EPowerSeries;
+		else throw NoriException("HeterogeneousMedia: unknown transmittance_estimator \"%s\" (expected \"ratio\", "
+			"\"track_length\", \"ratio_rr\" or \"power_series\")", estimator);
+		rrThreshold = trEstimator == ERatioRoulette ? propList.getFloat("rr_threshold", 0.1f) : 0.0f;
+		powerSeriesLookups = propList.getFloat("power_series_lookups", 1.0f);
+		measureVariance = propList.getBoolean("measure_variance", false);
+		if (powerSeriesLookups <= 0.0f)
+			throw NoriException("HeterogeneousMedia: power_series_lookups must be positive (got %f)", powerSeriesLookups);
+		shadowResolution = propList.getInteger("shadow_grid_resolution", 0);
+		std::string shadowMode = propList.getString("shadow_grid_mode", "cached");
+		if (shadowMode != "cached" && shadowMode != "control")
+			throw NoriException("HeterogeneousMedia: unknown shadow_grid_mode \"%s\" (expected \"cached\" or \"control\")", shadowMode);
+		shadowControl = shadowMode == "control";
+		m_octaves.count = propList.getInteger("ms_octaves", 1);
+		m_octaves.a = propList.getFloat("ms_scattering", 0.5f);
+		m_octaves.b = propList.getFloat("ms_extinction", 0.5f);
+		m_octaves.c = propList.getFloat("ms_anisotropy", 0.5f);
+		if (m_octaves.count < 1)
+			throw NoriException("HeterogeneousMedia: ms_octaves must be at least 1 (got %i)", m_octaves.count);
+		for (float f : { m_octaves.a, m_octaves.b, m_octaves.c })
+			if (f < 0.0f || f > 1.0f)
+				throw NoriException("HeterogeneousMedia: the ms_scattering, ms_extinction and ms_anisotropy factors must be in [0, 1] (got %f)", f);
+		m_densityKind = EGenericDensity;
+		if (bakeGrid != "dense" && bakeGrid != "sparse")
+			throw NoriException("HeterogeneousMedia: unknown bake_grid \"%s\" (expected \"dense\" or \"sparse\")", bakeGrid);
 		mu_max = max_rho * (sigma_a + sigma_s);
 	}
 
+	void activate() override {
+		if (!m_densityFunction)
+			throw NoriException("HeterogeneousMedia requires a density function!");
+		if (devirtualize) {
+			if (dynamic_cast<const Cloud*>(m_densityFunction)) m_densityKind = ECloudDensity;
+			else if (dynamic_cast<const CloudSmall*>(m_densityFunction)) m_densityKind = ECloudSmallDensity;
+			else if (dynamic_cast<const Sky*>(m_densityFunction)) m_densityKind = ESkyDensity;
+		}
+		buildCaches();
+	}
+
+	void setTime(float time) override {
+		if (!m_densityFunction->isAnimated() || time == m_densityFunction->getTime())
+			return;
+		m_densityFunction->setTime(time);
+		buildCaches();
+	}
+
+	/// Bakes the density and builds the majorant grid, as requested by the properties
+	void buildCaches() {
+		if (bakeResolution > 0) {
+			if (!m_mesh)
+				throw NoriException("HeterogeneousMedia: baking the density requires a mesh!");
+			if (bakeGrid == "sparse")
+				m_bricks.bake(m_densityFunction, m_accel->getBoundingBox(), bakeResolution, bakeBits);
+			else
+				m_grid.bake(m_densityFunction, m_accel->getBoundingBox(), bakeResolution);
+		}
+		if (majorantResolution > 0) {
+			if (!m_mesh)
+				throw NoriException("HeterogeneousMedia: the majorant grid requires a mesh!");
+			const BoundingBox3f& bbox = m_accel->getBoundingBox();
+			/* Lower bounds are only needed as controls of the residual trackers,
+			   which are only unbiased if the controls never exceed the density */
+			bool controls = residualTracking || decompositionTracking;
+			typedef std::function<float(const BoundingBox3f&)> Bound;
+			if (m_bricks.isBaked()) {
+				m_majorants.build(bbox, majorantResolution, [&](const BoundingBox3f& cell) { return m_bricks.maxValue(cell); },
+					controls ? Bound([&](const BoundingBox3f& cell) { return m_bricks.minValue(cell); }) : nullptr);
+			} else if (m_grid.isBaked()) {
+				m_majorants.build(bbox, majorantResolution, [&](const BoundingBox3f& cell) { return m_grid.maxValue(cell); },
+					controls ? Bound([&](const BoundingBox3f& cell) { return m_grid.minValue(cell); }) : nullptr);
+			} else if (sampledMajorants) {
+				/* Procedural densities are estimated by sampling them a few times
+				   per macrocell. Features thinner than the sample spacing are
+				   covered by also including the samples of a one sample wide
+				   border, plus a relative margin. This is no bound: the trackers
+				   are biased wherever the noise peaks between samples, which the
+				   majorant violations of the statistics count. The densities never
+				   exceed 1, which is kept as a hard bound. The sampled minima are no
+				   lower bounds either (clouds have empty gaps), so the controls are 0 */
+				cout << "Warning: HeterogeneousMedia: the sampled majorants may underestimate the density, "
+					"tracking against them is biased" << endl;
+				DensityGrid samples;
+				samples.bake(m_densityFunction, bbox, 4 * majorantResolution + 1);
+				Vector3f border = bbox.getExtents().cwiseQuotient((samples.getResolution() - Vector3i::Ones()).cast<float>());
+				m_majorants.build(bbox, majorantResolution, [&](const BoundingBox3f& cell) {
+					BoundingBox3f dilated(cell.min - border, cell.max + border);
+					return std::min(1.0f, (1.0f + majorantMargin) * samples.maxValue(dilated));
+				}, controls ? Bound([](const BoundingBox3f& cell) { return 0.0f; }) : nullptr);
+			} else {
+				/* Procedural densities never exceed 1, and are exactly 0 in the
+				   cells that DensityFunction::emptyDistance() proves empty from
+				   their center. Both bounds hold everywhere in the cell */
+				m_majorants.build(bbox, majorantResolution, [&](const BoundingBox3f& cell) {
+					return m_densityFunction->emptyDistance(cell.getCenter()) > 0.5f * cell.getExtents().norm() ? 0.0f : 1.0f;
+				}, controls ? Bound([](const BoundingBox3f& cell) { return 0.0f; }) : nullptr);
+			}
+		}
+		if (controlDensity > 0.0f && !m_majorants.isBuilt()) {
+			// The global control must bound the density from below everywhere, which only a baked grid can prove
+			if (!m_grid.isBaked() && !m_bricks.isBaked())
+				throw NoriException("HeterogeneousMedia: control_density requires a baked density (bake_resolution), "
+					"a procedural density has no provable lower bound");
+			const BoundingBox3f& bbox = m_accel->getBoundingBox();
+			float minDensity = m_bricks.isBaked() ? m_bricks.minValue(bbox) : m_grid.minValue(bbox);
+			if (controlDensity > minDensity)
+				throw NoriException("HeterogeneousMedia: control_density %f exceeds the smallest baked density %f, "
+					"the residual trackers would be biased", controlDensity, minDensity);
+		}
+		buildShadowGrids();
+	}
+
+	void cacheLightTransmittance(const std::vector<Emitter*>& lights) override {
+		if (shadowResolution <= 0)
+			return;
+		if (!m_mesh)
+			throw NoriException("HeterogeneousMedia: the light transmittance grids require a mesh!");
+		m_shadowGrids.clear();
+		for (const Emitter* light : lights) {
+			// Only point lights have a single position that all shadow rays end at
+			if (light->getEmitterType() != EmitterType::EMITTER_POINT) continue;
+			EmitterQueryRecord lRec(Point3f(0.0f, 0.0f, 0.0f));
+			light->sample(lRec, Point2f(0.5f, 0.5f), 0.0f);
+			m_shadowGrids.push_back(ShadowGrid{ light, lRec.p, DensityGrid() });
+		}
+		buildShadowGrids();
+	}
+
+	/// Ray marches the optical depth toward each cached light from the vertices of its grid
+	void buildShadowGrids() {
+		if (m_shadowGrids.empty())
+			return;
+		const BoundingBox3f& bbox = m_accel->getBoundingBox();
+		// Two steps per grid cell
+		float step = 0.5f * bbox.getExtents().maxCoeff() / std::max(1, shadowResolution - 1);
+		cout << "Caching the transmittance toward " << m_shadowGrids.size() << " light(s) .. ";
+		cout.flush();
+		Timer timer;
+		size_t memory = 0;
+		for (ShadowGrid& grid : m_shadowGrids) {
+			grid.depth.build(bbox, shadowResolution, [&](const Point3f& p) {
+				return dispatchDensity([&](auto df) { return marchDepth(df, p, grid.position, step); });
+			});
+			memory += grid.depth.getMemoryUsage();
+		}
+		cout << "done (took " << timer.elapsedString() << " and " << memString(memory) << ")." << endl;
+	}
+
+	/// Optical depth from \c p to \c light, ray marched with steps of at most \c step over the non-empty macrocells
+	template <typename Density>
+	float marchDepth(const Density* df, const Point3f& p, const Point3f& light, float step) const {
+		Vector3f d = light - p;
+		float dist = d.norm();
+		Ray3f ray(p, d / dist);
+		MediaBoundaries medBound;
+		if (dist <= 0.0f || !rayIntersectBoundaries(ray, medBound))
+			return 0.0f;
+		float depth = 0.0f;
+		for (int i = 0; i < medBound.intervalCount && medBound.tEnter(i) < dist; i++)
+			forEachSegment(ray, medBound.tEnter(i), std::min(dist, medBound.tExit(i)), [&](float t0, float t1, float majorant, float control) {
+				if (majorant <= 0.0f) return false;
+				int n = std::max(1, (int) std::ceil((t1 - t0) / step));
+				float h = (t1 - t0) / n, sum = 0.0f;
+				for (int k = 0; k < n; k++)
+					sum += density(df, ray(t0 + (k + 0.5f) * h));
+				depth += sum * h;
+				return false;
+			});
+		return depth * mu_max;
+	}
+
 	MediaCoeffs getMediaCoeffs(const Point3f& p) const override {
-		float d = m_densityFunction->eval(p);
+		float d = density(m_densityFunction, p);
 		float mu_a = d * max_rho * sigma_a;
 		float mu_s = d * max_rho * sigma_s;
 		return {mu_a, mu_s, mu_max};
 	}
 
+	/// Delta tracking against the concrete density type
+	template <typename Density>
+	bool deltaTrack(const Density* df, const Ray3f& ray, const MediaBoundaries& boundaries, Sampler* sampler, MediaIntersection& medIts) const {
+		float t = 0.0f, mu_t = 0.0f;
+		uint64_t lookups = 0, violations = 0;
+		bool collided = false;
+		// Free flights are memoryless, so tracking restarts at each interval
+		for (int i = 0; i < boundaries.intervalCount && !collided; i++) {
+			collided = track(df, ray, boundaries.tEnter(i), boundaries.tExit(i), sampler, [&](float tc, float majorant) {
+				lookups++;
+				mu_t = density(df, ray.o + ray.d * tc) * mu_max;
+				if (mu_t > majorant) violations++;
+				t = tc;
+				// Real collision with p = mu_t / majorant
+				return sampler->next1D() < mu_t / majorant;
+			});
+		}
+		TrackingStats& stats = m_stats.local();
+		stats.deltaCalls++;
+		stats.deltaLookups += lookups;
+		stats.nullCollisions += lookups - (collided ? 1 : 0);
+		stats.majorantViolations += violations;
+		if (!collided) return false;
+		medIts = MediaIntersection(ray.o + ray.d * t, t, this, boundaries, mu_t);
+		return true;
+	}
+
+	/**
+	 * \brief Decomposition tracking (Kutz et al. 2017) against the concrete density type
+	 *
+	 * Splits the extinction into the control of each segment plus a residual.
+	 * Collisions with the control are sampled analytically and the residual
+	 * is delta tracked against <tt>majorant - control</tt>, the earliest of
+	 * the two wins. Dense regions where the control is close to the majorant
+	 * need almost no density lookups.
+	 */
+	template <typename Density>
+	bool decompositionTrack(const Density* df, const Ray3f& ray, const MediaBoundaries& boundaries, Sampler* sampler, MediaIntersection& medIts) const {
+		float t = 0.0f, mu_t = 0.0f;
+		uint64_t lookups = 0, violations = 0, controlViolations = 0;
+		bool controlCollision = false;
+		// Optical depths left to travel for each component, carried over between segments
+		float tauControl = -log(1 - sampler->next1D());
+		float tauResidual = -log(1 - sampler->next1D());
+		auto segment = [&](float t0, float t1, float majorant, float control) {
+			float tEnd = t1;
+			if (control > 0.0f) {
+				float tc = t0 + tauControl / control;
+				if (tc < t1) {
+					tEnd = tc;
+					controlCollision = true;
+				} else tauControl -= (t1 - t0) * control;
+			}
+			float residual = majorant - control;
+			while (residual > 0.0f) {
+				if (control <= 0.0f) t0 = skipZero(df, ray, t0, tEnd);
+				float tr = t0 + tauResidual / residual;
+				if (tr >= tEnd) {
+					tauResidual -= (tEnd - t0) * residual;
+					break;
+				}
+				lookups++;
+				mu_t = density(df, ray(tr)) * mu_max;
+				if (mu_t > majorant) violations++;
+				if (mu_t < control) controlViolations++;
+				t0 = tr;
+				tauResidual = -log(1 - sampler->next1D());
+				// Real collision with the residual with p = (mu_t - control) / residual
+				if (sampler->next1D() * residual < mu_t - control) {
+					t = tr;
+					controlCollision = false;
+					return true;
+				}
+			}
+			if (!controlCollision) return false;
+			lookups++;
+			t = tEnd;
+			mu_t = density(df, ray(t)) * mu_max;
+			if (mu_t < control) controlViolations++;
+			return true;
+		};
+		bool collided = false;
+		for (int i = 0; i < boundaries.intervalCount && !collided; i++)
+			collided = forEachSegment(ray, boundaries.tEnter(i), boundaries.tExit(i), segment);
+		TrackingStats& stats = m_stats.local();
+		stats.deltaCalls++;
+		stats.deltaLookups += lookups;
+		stats.nullCollisions += lookups - (collided ? 1 : 0);
+		stats.majorantViolations += violations;
+		stats.controlCollisions += controlCollision ? 1 : 0;
+		stats.controlViolations += controlViolations;
+		if (!collided) return false;
+		medIts = MediaIntersection(ray.o + ray.d * t, t, this, boundaries, mu_t);
+		return true;
+	}
+
 	bool rayIntersectSample(const Ray3f& ray, const MediaBoundaries& boundaries, Sampler* sampler, MediaIntersection& medIts) const override {
 		if (!boundaries.intersected) return false;
-		else {
-			float t = boundaries.wasInside ? 0.0f : boundaries.tBoundary;
-			MediaCoeffs cfs;
-			int i = 0;
-			while (true) {
-				i++;
-				t += sampleDist(sampler->next1D());
-				if (t > boundaries.tOut) {
-					return false;
+		if (decompositionTracking)
+			return dispatchDensity([&](auto df) { return decompositionTrack(df, ray, boundaries, sampler, medIts); });
+		return dispatchDensity([&](auto df) { return deltaTrack(df, ray, boundaries, sampler, medIts); });
+	}
+
+	/**
+	 * \brief Russian roulette on a transmittance estimate, returns true if it was killed
+	 *
+	 * Estimates below \c rrThreshold survive with a probability proportional
+	 * to \c full (the transmittance so far, including analytic factors) and
+	 * are reweighted, so that nearly opaque paths stop tracking early.
+	 */
+	bool roulette(float& tr, float full, Sampler* sampler) const {
+		if (full >= rrThreshold) return false;
+		float p = full / rrThreshold;
+		if (sampler->next1D() >= p) {
+			tr = 0.0f;
+			return true;
+		}
+		tr /= p;
+		return false;
+	}
+
+	/// Ratio tracking against the concrete density type
+	template <typename Density>
+	float ratioTrack(const Density* df, const Ray3f& ray, float tMin, float tMax, Sampler* sampler, uint64_t& lookups) const {
+		// Ratio tracking, similar from PBRT
+		// https://www.pbr-book.org/3ed-2018/Light_Transport_II_Volume_Rendering/Sampling_Volume_Scattering
+		float tr = 1.0f;
+		uint64_t violations = 0;
+		track(df, ray, tMin, tMax, sampler, [&](float t, float majorant) {
+			lookups++;
+			float mu_t = density(df, ray(t)) * mu_max;
+			if (mu_t > majorant) violations++;
+			/// Clamped in case a sampled majorant underestimates the density
+			tr *= std::max(0.0f, 1 - mu_t / majorant);
+			return tr <= 0.0f || roulette(tr, tr, sampler);
+		});
+		if (violations) m_stats.local().majorantViolations += violations;
+		return tr;
+	}
+
+	/**
+	 * \brief Residual ratio tracking (Nov\'ak et al. 2014) against the concrete density type
+	 *
+	 * The control part of the extinction is attenuated analytically and only
+	 * the residual <tt>mu_t - control</tt> is ratio tracked, against
+	 * <tt>majorant - control</tt>. Both the number of lookups and the variance
+	 * shrink with the gap between the control and the majorant.
+	 */
+	template <typename Density>
+	float residualRatioTrack(const Density* df, const Ray3f& ray, float tMin, float tMax, Sampler* sampler, uint64_t& lookups) const {
+		float tr = 1.0f, controlDepth = 0.0f;
+		uint64_t violations = 0, controlViolations = 0;
+		float tau = -log(1 - sampler->next1D());
+		forEachSegment(ray, tMin, tMax, [&](float t0, float t1, float majorant, float control) {
+			controlDepth += control * (t1 - t0);
+			float residual = majorant - control;
+			while (residual > 0.0f) {
+				if (control <= 0.0f) t0 = skipZero(df, ray, t0, t1);
+				float t = t0 + tau / residual;
+				if (t >= t1) {
+					tau -= (t1 - t0) * residual;
+					break;
 				}
-				cfs = this->getMediaCoeffs(ray.o + ray.d * t);
-				// Intersection with p = mu_t / mu_max
-				if ((cfs.mu_n / mu_max) < sampler->next1D()) break;
+				lookups++;
+				float mu_t = density(df, ray(t)) * mu_max;
+				if (mu_t > majorant) violations++;
+				// Below the control the weight exceeds 1, which keeps the estimate unbiased
+				if (mu_t < control) controlViolations++;
+				tr *= std::max(0.0f, 1 - (mu_t - control) / residual);
+				if (tr <= 0.0f) return true;
+				t0 = t;
+				tau = -log(1 - sampler->next1D());
 			}
-			medIts = MediaIntersection(ray.o + ray.d * t, t, this, boundaries, cfs.mu_a + cfs.mu_s);
-			return true;
+			return roulette(tr, tr * std::exp(-controlDepth), sampler);
+		});
+		if (violations || controlViolations) {
+			TrackingStats& stats = m_stats.local();
+			stats.majorantViolations += violations;
+			stats.controlViolations += controlViolations;
+		}
+		return tr * std::exp(-controlDepth);
+	}
+
+	/// Track-length estimator: 1 if delta tracking reaches \c tMax without a real collision, 0 otherwise
+	template <typename Density>
+	float trackLength(const Density* df, const Ray3f& ray, float tMin, float tMax, Sampler* sampler, uint64_t& lookups) const {
+		uint64_t violations = 0;
+		bool collided = track(df, ray, tMin, tMax, sampler, [&](float t, float majorant) {
+			lookups++;
+			float mu_t = density(df, ray(t)) * mu_max;
+			if (mu_t > majorant) violations++;
+			return sampler->next1D() * majorant < mu_t;
+		});
+		if (violations) m_stats.local().majorantViolations += violations;
+		return collided ? 0.0f : 1.0f;
+	}
+
+	/// Lookups of a ray march over <tt>[tMin, tMax]</tt>, \c powerSeriesLookups per unit of its majorant optical depth
+	int marchSamples(const Ray3f& ray, float tMin, float tMax) const {
+		float majorantDepth = 0.0f;
+		forEachSegment(ray, tMin, tMax, [&](float t0, float t1, float majorant, float control) {
+			majorantDepth += majorant * (t1 - t0);
+			return false;
+		});
+		return clamp((int) std::ceil(majorantDepth * powerSeriesLookups), 1, 1024);
+	}
+
+	/// Unbiased estimate of the optical depth of <tt>[tMin, tMax]</tt>, from \c samples stratified lookups with a single jittered offset
+	template <typename Density>
+	float jitteredDepth(const Density* df, const Ray3f& ray, float tMin, float tMax, int samples, Sampler* sampler, uint64_t& lookups) const {
+		float step = (tMax - tMin) / samples;
+		float u = sampler->next1D(), sum = 0.0f;
+		for (int i = 0; i < samples; i++)
+			sum += density(df, ray(tMin + (i + u) * step));
+		lookups += samples;
+		return sum * mu_max * step;
+	}
+
+	/**
+	 * \brief Unbiased power-series estimator (after Kettunen et al. 2021)
+	 *
+	 * Expands <tt>exp(-tau) = exp(-c) sum_k (c - tau)^k / k!</tt> around the
+	 * optical depth \c c of a first jittered ray march. Every factor of the
+	 * series uses an independent ray march with \c powerSeriesLookups
+	 * stratified lookups per unit of majorant optical depth, so each term is
+	 * unbiased, and the series is cut by Russian roulette on the magnitude of
+	 * the last term. The estimate is not clamped and can leave [0, 1] when
+	 * the marches are too coarse for the density.
+	 */
+	template <typename Density>
+	float powerSeries(const Density* df, const Ray3f& ray, float tMin, float tMax, Sampler* sampler, uint64_t& lookups) const {
+		int samples = marchSamples(ray, tMin, tMax);
+		auto opticalDepth = [&]() { return jitteredDepth(df, ray, tMin, tMax, samples, sampler, lookups); };
+		float pivot = opticalDepth();
+		float sum = 1.0f, term = 1.0f;
+		for (int k = 1; k <= 64; k++) {
+			if (k > 1) {
+				float p = std::min(1.0f, 2.0f * std::abs(term));
+				if (sampler->next1D() >= p) break;
+				term /= p;
+			}
+			term *= (pivot - opticalDepth()) / k;
+			sum += term;
+		}
+		return std::exp(-pivot) * sum;
+	}
+
+	/// Runs the selected transmittance estimator, counting its density lookups
+	template <typename Density>
+	float estimateTransmittance(const Density* df, const Ray3f& ray, float tMin, float tMax, Sampler* sampler, uint64_t& lookups) const {
+		switch (trEstimator) {
+			case ETrackLength: return trackLength(df, ray, tMin, tMax, sampler, lookups);
+			case EPowerSeries: return powerSeries(df, ray, tMin, tMax, sampler, lookups);
+			default:
+				if (residualTracking) return residualRatioTrack(df, ray, tMin, tMax, sampler, lookups);
+				return ratioTrack(df, ray, tMin, tMax, sampler, lookups);
 		}
 	}
 
+	/// Product of the estimates over the intervals of \c medBound up to distance \c tMax
+	template <typename Density>
+	float estimateTransmittance(const Density* df, const Ray3f& ray, const MediaBoundaries& medBound, float tMax, Sampler* sampler, uint64_t& lookups) const {
+		float tr = 1.0f;
+		for (int i = 0; i < medBound.intervalCount && medBound.tEnter(i) < tMax && tr > 0.0f; i++)
+			tr *= estimateTransmittance(df, ray, medBound.tEnter(i), std::min(tMax, medBound.tExit(i)), sampler, lookups);
+		return tr;
+	}
+
+	/**
+	 * \brief Ratio tracking of the residual to a control extinction fitted to a cached optical depth
+	 *
+	 * The control is \c k times the majorant, with \c k chosen so that its
+	 * optical depth up to \c tMax matches \c depth. It is attenuated
+	 * analytically, and the residual <tt>mu_t - control</tt> is ratio
+	 * tracked against the larger of the control and the rest of the
+	 * majorant, so every weight is in [0, 2]. The estimate is unbiased
+	 * whatever the cached depth, which only sets its variance.
+	 */
+	template <typename Density>
+	float controlledRatioTrack(const Density* df, const Ray3f& ray, const MediaBoundaries& medBound, float tMax, float depth, Sampler* sampler, uint64_t& lookups) const {
+		float majorantDepth = 0.0f;
+		for (int i = 0; i < medBound.intervalCount && medBound.tEnter(i) < tMax; i++)
+			forEachSegment(ray, medBound.tEnter(i), std::min(tMax, medBound.tExit(i)), [&](float t0, float t1, float majorant, float control) {
+				majorantDepth += majorant * (t1 - t0);
+				return false;
+			});
+		if (majorantDepth <= 0.0f) return 1.0f;
+		float k = clamp(depth / majorantDepth, 0.0f, 1.0f), rateScale = std::max(k, 1.0f - k);
+		float tr = 1.0f, tau = -log(1 - sampler->next1D());
+		for (int i = 0; i < medBound.intervalCount && medBound.tEnter(i) < tMax; i++)
+			forEachSegment(ray, medBound.tEnter(i), std::min(tMax, medBound.tExit(i)), [&](float t0, float t1, float majorant, float control) {
+				float rate = rateScale * majorant;
+				while (rate > 0.0f) {
+					float t = t0 + tau / rate;
+					if (t >= t1) {
+						tau -= (t1 - t0) * rate;
+						break;
+					}
+					lookups++;
+					float mu_t = density(df, ray(t)) * mu_max;
+					// Clamped in case the majorant underestimates the density
+					tr *= std::max(0.0f, 1 - (mu_t - k * majorant) / rate);
+					t0 = t;
+					tau = -log(1 - sampler->next1D());
+				}
+				return false;
+			});
+		return tr * std::exp(-k * majorantDepth);
+	}
+
+	/// Grid caching the optical depth toward \c light, if any
+	const ShadowGrid* findShadowGrid(const Emitter* light) const {
+		for (const ShadowGrid& grid : m_shadowGrids)
+			if (grid.light == light) return &grid;
+		return nullptr;
+	}
+
+	float lightTransmittance(const Point3f& x0, const Point3f& xz, const Emitter* light, const MediaBoundaries& medBound, Sampler* sampler) const override {
+		const ShadowGrid* grid = findShadowGrid(light);
+		if (!grid) return transmittance(x0, xz, medBound, sampler);
+		float tPts = (xz - x0).norm();
+		if (medBound.intervalCount == 0 || medBound.tEnter(0) >= tPts) return 1.0f;
+		Vector3f d = (xz - x0) / tPts;
+		// Up to the first entry the shadow ray crosses no media, so the depth there is the one from x0
+		float depth = grid->depth.lookup(x0 + d * medBound.tEnter(0));
+		if (!shadowControl) {
+			m_stats.local().shadowCached++;
+			return std::exp(-depth);
+		}
+
+		Ray3f ray(x0, d);
+		uint64_t lookups = 0;
+		float tr = dispatchDensity([&](auto df) { return controlledRatioTrack(df, ray, medBound, tPts, depth, sampler, lookups); });
+		TrackingStats& stats = m_stats.local();
+		stats.shadowControlled++;
+		if (measureVariance && segmentHash(x0, xz) % VarianceSamplingRate == 0) {
+			uint64_t extraLookups = 0;
+			float tr2 = dispatchDensity([&](auto df) { return controlledRatioTrack(df, ray, medBound, tPts, depth, sampler, extraLookups); });
+			stats.shadowVariance += 0.5 * (tr - tr2) * (tr - tr2);
+			stats.shadowVarianceSamples++;
+		}
+		stats.shadowLookups += lookups;
+		return tr;
+	}
+
+	/**
+	 * \brief Optical depth toward \c light, for the approximate multiple scattering
+	 *
+	 * The cached depth when the light has a grid, otherwise a jittered ray
+	 * march of each interval, with the lookups of the power-series marches.
+	 */
+	float opticalDepth(const Point3f& x0, const Point3f& xz, const Emitter* light, const MediaBoundaries& medBound, Sampler* sampler) const override {
+		float tPts = (xz - x0).norm();
+		if (medBound.intervalCount == 0 || medBound.tEnter(0) >= tPts) return 0.0f;
+		Vector3f d = (xz - x0) / tPts;
+		if (const ShadowGrid* grid = findShadowGrid(light))
+			return grid->depth.lookup(x0 + d * medBound.tEnter(0));
+
+		Ray3f ray(x0, d);
+		uint64_t lookups = 0;
+		float depth = 0.0f;
+		for (int i = 0; i < medBound.intervalCount && medBound.tEnter(i) < tPts; i++) {
+			float t0 = medBound.tEnter(i), t1 = std::min(tPts, medBound.tExit(i));
+			int samples = marchSamples(ray, t0, t1);
+			depth += dispatchDensity([&](auto df) { return jitteredDepth(df, ray, t0, t1, samples, sampler, lookups); });
+		}
+		return depth;
+	}
+
+	/// Hash of the bits of a segment's end points
+	static uint32_t segmentHash(const Point3f& x0, const Point3f& xz) {
+		uint32_t h = 0x9e3779b9u;
+		for (int i = 0; i < 3; i++) {
+			uint32_t a, b;
+			memcpy(&a, &x0[i], sizeof(a));
+			memcpy(&b, &xz[i], sizeof(b));
+			h = (h ^ a) * 0x85ebca6bu;
+			h = (h ^ b) * 0xc2b2ae35u;
+		}
+		return h ^ (h >> 16);
+	}
+
 	/// Transmittance between 2 points
 	virtual float transmittance(const Point3f& x0, const Point3f& xz, const MediaBoundaries& medBound, Sampler* sampler) const override {
 		float tPts = (xz - x0).norm();
 		Vector3f d = (xz - x0).normalized();
-		float tMin, tMax;
-		if (medBound.wasInside) {
-			tMin = 0;
-			tMax = std::min(tPts, medBound.tOut);
-		} else if (tPts > medBound.tBoundary) {
-			tMin = medBound.tBoundary;
-			tMax = std::min(tPts, medBound.tOut);
-		} else return 1.0f; // Case not intersecting media
-
-		// Ratio tracking, similar from PBRT
-		// https://www.pbr-book.org/3ed-2018/Light_Transport_II_Volume_Rendering/Sampling_Volume_Scattering
-		float tr = 1.0f;
-		float t = tMin;
-		while (true) {
-			t += sampleDist(sampler->next1D());
-			if (t > tMax) break;
-			MediaCoeffs mc = this->getMediaCoeffs(x0 + t*d);
-			/// Max-check just in case
-			tr *= (1 - std::max(0.0f, (mc.mu_a + mc.mu_s) / mc.mu_max));
+		Ray3f ray(x0, d);
+		uint64_t lookups = 0;
+		float tr = dispatchDensity([&](auto df) { return estimateTransmittance(df, ray, medBound, tPts, sampler, lookups); });
+		/* For a few segments, a second independent estimate of the same segment
+		   gives an unbiased sample of the estimator variance, (a - b)^2 / 2.
+		   They are picked from the end points rather than a shared counter, so
+		   the extra draws do not depend on how the threads interleave */
+		TrackingStats& stats = m_stats.local();
+		stats.trCalls++;
+		if (measureVariance && segmentHash(x0, xz) % VarianceSamplingRate == 0) {
+			uint64_t extraLookups = 0;
+			float tr2 = dispatchDensity([&](auto df) { return estimateTransmittance(df, ray, medBound, tPts, sampler, extraLookups); });
+			stats.trVariance += 0.5 * (tr - tr2) * (tr - tr2);
+			stats.trVarianceSamples++;
 		}
+		stats.trLookups += lookups;
 		return tr;
 	}
 
@@ -239,13 +1000,77 @@ public:
 				"  mu_t    = %f,\n"
 				"  pf      = %s\n"
 				"  df      = %s\n"
+				"  grid    = %s\n"
+				"  majorants = %s,\n"
+				"  majorant_bound = %s,\n"
+				"  residual_tracking = %s,\n"
+				"  decomposition_tracking = %s,\n"
+				"  control_density = %f,\n"
+				"  transmittance = %s,\n"
+				"  shadow_grids = %s,\n"
+				"  multiple_scattering = %s\n"
 				"]",
 				max_rho,
 				sigma_a,
 				sigma_s,
 				mu_max,
 				indent(pf, 2),
-				indent(df, 2));
+				indent(df, 2),
+				indent(m_bricks.isBaked() ? m_bricks.toString() : m_grid.toString(), 2),
+				indent(m_majorants.toString(), 2),
+				sampledMajorants ? "sampled" : "conservative",
+				residualTracking ? "yes" : "no",
+				decompositionTracking ? "yes" : "no",
+				controlDensity,
+				transmittanceEstimatorName(),
+				shadowResolution > 0 ? tfm::format("%i (%s)", shadowResolution, shadowControl ? "control" : "cached") : "off",
+				m_octaves.enabled() ? tfm::format("%i octaves (a = %g, b = %g, c = %g)", m_octaves.count, m_octaves.a, m_octaves.b, m_octaves.c) : "off");
+	}
+
+	/// Name of the transmittance estimator, for the statistics
+	std::string transmittanceEstimatorName() const {
+		std::string ratio = residualTracking ? "residual ratio tracking" : "ratio tracking";
+		switch (trEstimator) {
+			case ETrackLength: return "track-length transmittance";
+			case ERatioRoulette: return tfm::format("%s with roulette below %g", ratio, rrThreshold);
+			case EPowerSeries: return tfm::format("power-series transmittance (%g lookups per unit optical depth)", powerSeriesLookups);
+			default: return ratio;
+		}
+	}
+
+	std::string getStatistics() const override {
+		auto perCall = [](uint64_t n, uint64_t calls) { return calls ? (double) n / calls : 0.0; };
+		TrackingStats total = m_stats.combine([](TrackingStats a, const TrackingStats& b) { return a += b; });
+		// Mean variance of a single transmittance estimate, over the sampled calls
+		double variance = total.trVarianceSamples ? total.trVariance / total.trVarianceSamples : 0.0;
+		std::string trVariance = measureVariance ? tfm::format(", variance %.4g, cost x variance %.4g",
+				variance, perCall(total.trLookups, total.trCalls) * variance) : "";
+		std::string shadows;
+		if (!m_shadowGrids.empty()) {
+			double shadowVariance = total.shadowVarianceSamples ? total.shadowVariance / total.shadowVarianceSamples : 0.0;
+			shadows = tfm::format("\n  light transmittance grids: %llu cached lookups, %llu controlled calls, "
+				"%llu density lookups (%.2f per call)%s",
+				(unsigned long long) total.shadowCached, (unsigned long long) total.shadowControlled,
+				(unsigned long long) total.shadowLookups, perCall(total.shadowLookups, total.shadowControlled),
+				measureVariance ? tfm::format(", variance %.4g, cost x variance %.4g", shadowVariance,
+					perCall(total.shadowLookups, total.shadowControlled) * shadowVariance) : "");
+		}
+		return tfm::format(
+				"HeterogeneousMedia tracking statistics:\n"
+				"  %s: %llu calls, %llu density lookups (%.2f per call), %llu null collisions (%.2f per call)\n"
+				"  %s: %llu calls, %llu density lookups (%.2f per call)%s\n"
+				"  control collisions: %llu\n"
+				"  majorant violations: %llu, control violations: %llu%s",
+				decompositionTracking ? "decomposition tracking" : "delta tracking",
+				(unsigned long long) total.deltaCalls, (unsigned long long) total.deltaLookups,
+				perCall(total.deltaLookups, total.deltaCalls),
+				(unsigned long long) total.nullCollisions, perCall(total.nullCollisions, total.deltaCalls),
+				transmittanceEstimatorName(),
+				(unsigned long long) total.trCalls, (unsigned long long) total.trLookups,
+				perCall(total.trLookups, total.trCalls), trVariance,
+				(unsigned long long) total.controlCollisions,
+				(unsigned long long) total.majorantViolations, (unsigned long long) total.controlViolations,
+				shadows);
 	}
 };
 
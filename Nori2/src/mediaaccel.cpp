@@ -0,0 +1,58 @@
+#include <nori/mediaaccel.h>
+#include <nori/media.h>
+#include <algorithm>
+
+NORI_NAMESPACE_BEGIN
+
+void MediaAccel::build(const std::vector<PMedia*>& media) {
+	m_nodes.clear();
+	m_depth = 0;
+	std::vector<std::pair<BoundingBox3f, const PMedia*>> items;
+	for (const PMedia* m : media)
+		if (m->getBoundingBox().isValid())
+			items.emplace_back(m->getBoundingBox(), m);
+	if (items.empty())
+		return;
+	m_nodes.reserve(2 * items.size() - 1);
+	build(items, 0, items.size(), 1);
+}
+
+uint32_t MediaAccel::build(std::vector<std::pair<BoundingBox3f, const PMedia*>>& items, size_t begin, size_t end, uint32_t depth) {
+	if (depth >= 64)
+		throw NoriException("MediaAccel: the tree is too deep");
+	m_depth = std::max(m_depth, depth);
+	uint32_t index = (uint32_t) m_nodes.size();
+	m_nodes.push_back(Node());
+	BoundingBox3f bbox;
+	for (size_t i = begin; i < end; ++i)
+		bbox.expandBy(items[i].first);
+	m_nodes[index].bbox = bbox;
+	m_nodes[index].media = nullptr;
+
+	if (end - begin == 1) {
+		m_nodes[index].media = items[begin].second;
+		return index;
+	}
+
+	/* Median split of the centroids along the largest axis */
+	BoundingBox3f centroids;
+	for (size_t i = begin; i < end; ++i)
+		centroids.expandBy(items[i].first.getCenter());
+	int axis = centroids.getMajorAxis();
+	size_t mid = (begin + end) / 2;
+	std::nth_element(items.begin() + begin, items.begin() + mid, items.begin() + end,
+		[axis](const std::pair<BoundingBox3f, const PMedia*>& a, const std::pair<BoundingBox3f, const PMedia*>& b) {
+			return a.first.getCenter()[axis] < b.first.getCenter()[axis];
+		});
+
+	build(items, begin, mid, depth + 1);
+	uint32_t right = build(items, mid, end, depth + 1);
+	m_nodes[index].rightChild = right;
+	return index;
+}
+
+std::string MediaAccel::toString() const {
+	return tfm::format("MediaAccel[media = %i, depth = %i]", (int) (m_nodes.size() + 1) / 2, m_depth);
+}
+
+NORI_NAMESPACE_END
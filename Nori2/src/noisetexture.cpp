@@ -0,0 +1,168 @@
+#include <nori/noisetexture.h>
+#include <nori/timer.h>
+#include <filesystem/resolver.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <fstream>
+
+#if defined(PLATFORM_WINDOWS)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/// Layout of the cache file, followed by resolution^3 floats (x fastest)
+struct NoiseTextureHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t resolution;
+	uint32_t period;
+	uint32_t reserved;
+	uint64_t key;
+};
+
+static const char NoiseTextureMagic[8] = { 'N', 'O', 'R', 'I', 'N', 'O', 'I', 'S' };
+static const uint32_t NoiseTextureVersion = 1;
+
+NoiseTexture::NoiseTexture(int resolution, int period)
+	: m_res(resolution), m_period(period), m_data(nullptr), m_mapping(nullptr), m_mappingSize(0) {
+	if (resolution < 2)
+		throw NoriException("NoiseTexture: the resolution must be at least 2 (got %i)", resolution);
+	if (period < 1)
+		throw NoriException("NoiseTexture: the period must be positive (got %i)", period);
+	m_scale = (float) m_res / m_period;
+}
+
+NoiseTexture::~NoiseTexture() {
+	if (!m_mapping)
+		return;
+#if defined(PLATFORM_WINDOWS)
+	UnmapViewOfFile(m_mapping);
+#else
+	munmap(m_mapping, m_mappingSize);
+#endif
+}
+
+bool NoiseTexture::map(const std::string& filename, uint64_t key) {
+	size_t expectedSize = sizeof(NoiseTextureHeader) + getMemoryUsage();
+#if defined(PLATFORM_WINDOWS)
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	HANDLE mapping = nullptr;
+	if (GetFileSizeEx(file, &size) && (size_t) size.QuadPart == expectedSize)
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (!mapping)
+		return false;
+	void* base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	if (!base)
+		return false;
+#else
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat sb;
+	void* base = MAP_FAILED;
+	if (fstat(fd, &sb) == 0 && (size_t) sb.st_size == expectedSize)
+		base = mmap(nullptr, expectedSize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return false;
+#endif
+
+	const NoiseTextureHeader* header = static_cast<const NoiseTextureHeader*>(base);
+	if (memcmp(header->magic, NoiseTextureMagic, sizeof(NoiseTextureMagic)) != 0
+			|| header->version != NoiseTextureVersion || header->resolution != (uint32_t) m_res
+			|| header->period != (uint32_t) m_period || header->key != key) {
+#if defined(PLATFORM_WINDOWS)
+		UnmapViewOfFile(base);
+#else
+		munmap(base, expectedSize);
+#endif
+		return false;
+	}
+
+	m_mapping = base;
+	m_mappingSize = expectedSize;
+	m_data = reinterpret_cast<const float*>(static_cast<const char*>(base) + sizeof(NoiseTextureHeader));
+	return true;
+}
+
+void NoiseTexture::load(const std::string& cacheDir, uint32_t mode, uint32_t seed,
+		const std::function<float(const Vector3f&)>& noise) {
+	uint64_t key = ((uint64_t) mode << 32) | seed;
+
+	if (!cacheDir.empty()) {
+		filesystem::path dir(cacheDir);
+		if (!dir.is_absolute() && getFileResolver()->size() > 0)
+			dir = (*getFileResolver())[0] / dir;
+		m_filename = (dir / filesystem::path(tfm::format("noise_m%u_s%08x_r%i_p%i.bin",
+			mode, seed, m_res, m_period))).str();
+
+		Timer timer;
+		if (map(m_filename, key)) {
+			cout << "Mapped the noise texture \"" << m_filename << "\" (took "
+				<< timer.elapsedString() << " and " << memString(getMemoryUsage()) << ")." << endl;
+			return;
+		}
+	}
+
+	cout << "Baking a " << m_res << "^3 noise texture (period " << m_period << ") .. ";
+	cout.flush();
+	Timer timer;
+	m_memory.resize((size_t) m_res * m_res * m_res);
+	tbb::parallel_for(tbb::blocked_range<int>(0, m_res * m_res), [&](const tbb::blocked_range<int>& range) {
+		for (int row = range.begin(); row < range.end(); ++row) {
+			int y = row % m_res, z = row / m_res;
+			float* out = &m_memory[(size_t) row * m_res];
+			for (int x = 0; x < m_res; x++)
+				out[x] = noise(Vector3f(x, y, z) / m_scale);
+		}
+	});
+	m_data = m_memory.data();
+	cout << "done (took " << timer.elapsedString() << " and " << memString(getMemoryUsage()) << ")." << endl;
+
+	if (m_filename.empty())
+		return;
+
+	/* Failing to write the cache only costs a bake on the next run */
+	filesystem::path dir = filesystem::path(m_filename).parent_path();
+	if (!dir.empty() && !dir.exists())
+		filesystem::create_directories(dir);
+	NoiseTextureHeader header;
+	memcpy(header.magic, NoiseTextureMagic, sizeof(NoiseTextureMagic));
+	header.version = NoiseTextureVersion;
+	header.resolution = (uint32_t) m_res;
+	header.period = (uint32_t) m_period;
+	header.reserved = 0;
+	header.key = key;
+	std::ofstream os(m_filename, std::ios::binary);
+	os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	os.write(reinterpret_cast<const char*>(m_memory.data()), getMemoryUsage());
+	if (!os)
+		cerr << "Warning: could not write the noise texture cache \"" << m_filename << "\"" << endl;
+}
+
+std::string NoiseTexture::toString() const {
+	return tfm::format(
+			"NoiseTexture[\n"
+			"  resolution = %i,\n"
+			"  period = %i,\n"
+			"  cache = \"%s\" (%s)\n"
+			"]",
+			m_res,
+			m_period,
+			m_filename,
+			isMapped() ? "mapped" : "baked");
+}
+
+NORI_NAMESPACE_END
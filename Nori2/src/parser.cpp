@@ -62,6 +62,7 @@ NoriObject *loadFromXML(const std::string &filename) {
 		ETexture       = NoriObject::ETexture,
 		EPhaseFunction = NoriObject::EPhaseFunction,
 		EDensityFunction = NoriObject::EDensityFunction,
+		EDensityNode   = NoriObject::EDensityNode,
 		EEmitter       = NoriObject::EEmitter,
 		EMedium        = NoriObject::EMedium,
 		ECamera        = NoriObject::ECamera,
@@ -98,6 +99,7 @@ NoriObject *loadFromXML(const std::string &filename) {
 	tags["medium"]     = EMedium;
 	tags["phase"]      = EPhaseFunction;
 	tags["density"]    = EDensityFunction;
+	tags["node"]       = EDensityNode;
 	tags["integrator"] = EIntegrator;
 	tags["sampler"]    = ESampler;
 	tags["rfilter"]    = EReconstructionFilter;
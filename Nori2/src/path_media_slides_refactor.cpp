@@ -4,6 +4,14 @@
 #include <nori/emitter.h>
 #include <nori/bsdf.h>
 #include <nori/phasefunction.h>
+#include <nori/radiancecache.h>
+#include <nori/sdtree.h>
+#include <nori/camera.h>
+#include <nori/block.h>
+#include <nori/sampler.h>
+#include <nori/timer.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
 
 NORI_NAMESPACE_BEGIN
 
@@ -16,6 +24,291 @@ private:
 
 public :
 	PathTracingMediaSlidesRefactor(const PropertyList &props) {
+		m_maxDepth = props.getInteger("max_depth", 64);
+		m_rrDepth = props.getInteger("rr_depth", 3);
+		if (m_maxDepth <= 0 || m_rrDepth < 0)
+			throw NoriException("PathTracingMediaSlidesRefactor: max_depth must be positive and rr_depth non-negative");
+
+		m_useCache = props.getBoolean("radiance_cache", false);
+		m_cacheDepth = props.getInteger("cache_depth", 1);
+		m_cacheCellSize = props.getFloat("cache_cell_size", 0.0f);
+		m_cacheCells = props.getInteger("cache_cells", 1 << 17);
+		m_pilotSpp = props.getInteger("cache_pilot_spp", 8);
+		m_cacheMinSamples = props.getInteger("cache_min_samples", 32);
+		if (m_cacheDepth < 0 || m_cacheCells <= 0 || m_pilotSpp <= 0 || m_cacheMinSamples <= 0)
+			throw NoriException("PathTracingMediaSlidesRefactor: invalid radiance cache parameters");
+
+		m_useGuiding = props.getBoolean("guiding", false);
+		m_guidePasses = props.getInteger("guide_passes", 4);
+		m_guideSpp = props.getInteger("guide_spp", 1);
+		m_guideFraction = props.getFloat("guide_fraction", 0.25f);
+		m_guideSpatialThreshold = props.getInteger("guide_spatial_threshold", 2000);
+		m_guideDirectionalThreshold = props.getFloat("guide_directional_threshold", 0.01f);
+		if (m_guidePasses <= 0 || m_guideSpp <= 0 || m_guideFraction < 0.0f || m_guideFraction > 1.0f
+		    || m_guideSpatialThreshold <= 0 || m_guideDirectionalThreshold <= 0.0f)
+			throw NoriException("PathTracingMediaSlidesRefactor: invalid guiding parameters");
+
+		m_equiangular = props.getBoolean("equiangular", false);
+	}
+
+	/**
+	 * \brief Train the guiding tree and fill the radiance cache
+	 *
+	 * The guiding passes double their sample count, each one samples the
+	 * tree learned by the previous ones. The radiance cache is then filled
+	 * with a pilot pass, guided if enabled.
+	 */
+	void preprocess(const Scene* scene) override {
+		if ((!m_useCache && !m_useGuiding) || !scene->hasMedia())
+			return;
+		BoundingBox3f bounds;
+		for (const PMedia* media : scene->getMedia())
+			bounds.expandBy(media->getBoundingBox());
+
+		if (m_useGuiding) {
+			cout << "Training the guiding tree .. ";
+			cout.flush();
+			Timer timer;
+			m_guide.configure(bounds);
+			for (int pass = 0; pass < m_guidePasses; ++pass) {
+				int spp = m_guideSpp << pass;
+				tracePass(scene, spp, pass + 1, nullptr, &m_guide);
+				m_guide.refine((uint32_t) (m_guideSpatialThreshold * std::sqrt((float) spp)),
+				               m_guideDirectionalThreshold, MaxGuideDepth);
+			}
+			cout << "done (took " << timer.elapsedString() << " and " << memString(m_guide.getMemoryUsage()) << ")." << endl;
+			cout << m_guide.toString() << endl;
+		}
+
+		if (m_useCache) {
+			cout << "Building radiance cache .. ";
+			cout.flush();
+			Timer timer;
+			float cellSize = m_cacheCellSize > 0.0f ? m_cacheCellSize : bounds.getExtents().maxCoeff() / 64.0f;
+			m_cache.configure(bounds, cellSize, (size_t) m_cacheCells);
+			// Past the seeds of the guiding passes, so that the cache is not correlated with either
+			tracePass(scene, m_pilotSpp, m_guidePasses + 1, &m_cache, nullptr);
+			cout << "done (took " << timer.elapsedString() << " and " << memString(m_cache.getMemoryUsage()) << ")." << endl;
+			cout << m_cache.toString() << endl;
+		}
+	}
+
+	/**
+	 * \brief Trace \c spp camera paths per pixel that fill \c pilot or \c training
+	 *
+	 * \param seed
+	 *	 Passes with different seeds draw different sample sequences, 0 is
+	 *	 the sequence of the render and is never used here
+	 */
+	void tracePass(const Scene* scene, int spp, int seed, RadianceCache* pilot, SDTree* training) const {
+		const Camera* camera = scene->getCamera();
+		BlockGenerator blockGenerator(camera->getOutputSize(), NORI_BLOCK_SIZE);
+		tbb::parallel_for(tbb::blocked_range<int>(0, blockGenerator.getBlockCount()), [&](const tbb::blocked_range<int>& range) {
+			ImageBlock block(Vector2i(NORI_BLOCK_SIZE), camera->getReconstructionFilter());
+			std::unique_ptr<Sampler> sampler(scene->getSampler()->clone());
+			for (int i = range.begin(); i < range.end(); ++i) {
+				blockGenerator.next(block);
+				Point2i offset = block.getOffset();
+				Vector2i size = block.getSize();
+				block.setOffset(offset + Point2i(seed * camera->getOutputSize().x(), 0));
+				sampler->prepare(block);
+				for (int y = 0; y < size.y(); ++y)
+					for (int x = 0; x < size.x(); ++x)
+						for (int j = 0; j < spp; ++j) {
+							Point2f pixelSample = Point2f((float) (x + offset.x()), (float) (y + offset.y())) + sampler->next2D();
+							Ray3f ray;
+							camera->sampleRay(ray, pixelSample, sampler->next2D());
+							LiT(scene, sampler.get(), ray, pilot, training);
+						}
+			}
+		});
+	}
+
+	/// Density of the scattered directions at a media vertex: the phase function, mixed with the guide if any
+	float scatterPdf(const PhaseFunction* pf, const PFQueryRecord& mRec, const SDTree::Leaf* guide) const {
+		float pdf = pf->pdf(mRec);
+		if (guide)
+			pdf = m_guideFraction * guide->sampling.pdf(mRec.wo, PhaseWeight{ pf, mRec.wi })
+			      + (1.0f - m_guideFraction) * pdf;
+		return pdf;
+	}
+
+	/**
+	 * \brief The guide samples its product with the phase function
+	 *
+	 * Large quadrants see a smoothed phase function, its anisotropy reduced by
+	 * the mean cosine of a cone of the same solid angle, so that a narrow lobe
+	 * is not missed by their centers.
+	 */
+	struct PhaseWeight {
+		const PhaseFunction* pf;
+		Vector3f wi;
+		float operator()(const Vector3f& wo, float solidAngle) const {
+			return pf->eval(PFQueryRecord(wi, wo), 1.0f - solidAngle * INV_FOURPI).getLuminance();
+		}
+	};
+
+	/// Guide of the media vertex at \c p, if it learned something there
+	const SDTree::Leaf* guideAt(const Point3f& p) const {
+		if (!m_guide.isValid())
+			return nullptr;
+		const SDTree::Leaf* guide = &m_guide.lookup(p);
+		return guide->isTrained() ? guide : nullptr;
+	}
+
+	/**
+	 * \brief Equiangular sampling of the distances along a ray segment (Kulla and Fajardo 2012)
+	 *
+	 * The density is proportional to the inverse squared distance to a point
+	 * \c y of an emitter, over the homogeneous media crossed by the segment.
+	 * It is combined with free-flight sampling by the balance heuristic, the
+	 * free-flight density being approximated with the majorants of all the
+	 * media as extinction. Heterogeneous media are left to free-flight
+	 * sampling: their majorants overestimate the extinction, and equiangular
+	 * samples would take over the dense regions where they do poorly.
+	 */
+	struct EquiangularSegment {
+		/// Emitter chosen for the segment, also used by the next event estimation of its media vertices
+		const Emitter* emitter = nullptr;
+		float pdfEmitter = 1.0f;
+		/// Whether distances are sampled: the emitter has a position and the segment crosses media
+		bool active = false;
+		/// Point sampled on the emitter
+		EmitterQueryRecord light;
+		Ray3f ray;
+		/// Media along the ray, and the span the sampled ones cover up to the surface hit
+		MediaBoundariesList media;
+		float tA = 0.0f, tB = 0.0f;
+
+		/// Whether the distances in \c media are sampled equiangularly, the ones with approximate multiple scattering have their own estimate
+		static bool samples(const PMedia* media) {
+			return media->isHomogeneous() && !media->getScatteringOctaves().enabled();
+		}
+
+		/// Sample a distance toward \c light, with density \c pdf
+		float sample(float u, float& pdf) const {
+			float delta, D, thetaA, thetaB;
+			if (!angles(light.p, delta, D, thetaA, thetaB)) {
+				pdf = 0.0f;
+				return tA;
+			}
+			float t = std::min(std::max(delta + D * std::tan(thetaA + u * (thetaB - thetaA)), tA), tB);
+			pdf = D / ((thetaB - thetaA) * (D * D + (t - delta) * (t - delta)));
+			return t;
+		}
+
+		/// Density of sampling \c t toward the point \c y
+		float pdf(float t, const Point3f& y) const {
+			float delta, D, thetaA, thetaB;
+			if (!active || t < tA || t > tB || !angles(y, delta, D, thetaA, thetaB))
+				return 0.0f;
+			return D / ((thetaB - thetaA) * (D * D + (t - delta) * (t - delta)));
+		}
+
+		/// Stand-in for the density of free-flight sampling a collision at \c t, of extinction \c mu_t
+		float freeFlightPdf(float t, float mu_t) const {
+			float depth = 0.0f;
+			for (const MediaBoundaries& medBound : media)
+				depth += medBound.pMedia->getMu_t() * medBound.lengthInside(t);
+			return mu_t * std::exp(-depth);
+		}
+
+		/// Projection \c delta of \c y on the ray, distance \c D to it, and angles of the ends of the span
+		bool angles(const Point3f& y, float& delta, float& D, float& thetaA, float& thetaB) const {
+			delta = (y - ray.o).dot(ray.d);
+			D = (ray(delta) - y).norm();
+			if (D < Epsilon)
+				return false;
+			thetaA = std::atan2(tA - delta, D);
+			thetaB = std::atan2(tB - delta, D);
+			return thetaB > thetaA;
+		}
+	};
+
+	/**
+	 * \brief Choose the emitter of the segment of \c ray up to \c tmax, and a point on it
+	 *
+	 * Environment and distant emitters have no point to sample toward, the
+	 * segment is then inactive and free-flight sampling alone handles it.
+	 */
+	void setupEquiangular(const Scene* scene, Sampler* sampler, const Ray3f& ray, float tmax, EquiangularSegment& eq) const {
+		eq.emitter = scene->sampleEmitter(sampler->next1D(), eq.pdfEmitter);
+		eq.light = EmitterQueryRecord(ray.o);
+		eq.emitter->sample(eq.light, sampler->next2D(), 0);
+		EmitterType type = eq.emitter->getEmitterType();
+		if (type != EmitterType::EMITTER_POINT && type != EmitterType::EMITTER_AREA)
+			return;
+
+		eq.ray = Ray3f(ray.o, ray.d);
+		// The boundaries are found on the whole ray and clipped at tmax, so a medium holding the surface hit is kept
+		scene->rayIntersectMediaBoundaries(Ray3f(ray, ray.mint, tmax), eq.media);
+		eq.tA = INFINITY;
+		eq.tB = 0.0f;
+		for (const MediaBoundaries& medBound : eq.media) {
+			if (!EquiangularSegment::samples(medBound.pMedia))
+				continue;
+			eq.tA = std::min(eq.tA, medBound.tBoundary);
+			eq.tB = std::max(eq.tB, medBound.tOut);
+		}
+		if (eq.tA == INFINITY)
+			return;
+		eq.tA = std::max(eq.tA, ray.mint);
+		float delta, D, thetaA, thetaB;
+		eq.active = eq.angles(eq.light.p, delta, D, thetaA, thetaB);
+	}
+
+	/**
+	 * \brief Light of the emitter of \c eq scattered along \c ray, at a distance sampled equiangularly
+	 *
+	 * Every sampled medium holding the point scatters, weighted against the
+	 * free-flight collisions in it.
+	 */
+	Color3f EquiangularScattering(const Scene* scene, Sampler* sampler, const Ray3f& ray, const EquiangularSegment& eq) const {
+		float pdfT;
+		float t = eq.sample(sampler->next1D(), pdfT);
+		if (pdfT <= 0.0f)
+			return {0.0f};
+		Point3f x = ray(t);
+
+		// Emitted light reaching x from the point of the emitter, lazily since the point may lie outside of the media
+		Color3f Le(0.0f);
+		EmitterQueryRecord lRec;
+		bool lightReady = false;
+		Color3f L(0.0f);
+		for (const MediaBoundaries& medBound : eq.media) {
+			if (!EquiangularSegment::samples(medBound.pMedia) || !medBound.contains(t))
+				continue;
+			MediaCoeffs coeffs = medBound.pMedia->getMediaCoeffs(x);
+			if (coeffs.mu_s <= 0.0f)
+				continue;
+			if (!lightReady) {
+				lightReady = true;
+				if (eq.emitter->isDelta()) {
+					lRec = EmitterQueryRecord(x);
+					Le = eq.emitter->sample(lRec, Point2f(0.0f), 0);
+				} else {
+					lRec = EmitterQueryRecord(eq.emitter, x, eq.light.p, eq.light.n, eq.light.uv);
+					lRec.pdf = eq.emitter->pdf(lRec);
+					if (lRec.pdf > 0.0f)
+						Le = eq.emitter->eval(lRec) / lRec.pdf;
+				}
+				if (Le.isZero() || !scene->isVisible(x, lRec.p))
+					return {0.0f};
+				Le *= scene->transmittance(ray.o, x, eq.media, sampler)
+				      * scene->transmittance(x, lRec.p, eq.emitter, sampler) / eq.pdfEmitter;
+				if (Le.isZero())
+					return {0.0f};
+			}
+			const PhaseFunction* pf = medBound.pMedia->getPhaseFunction();
+			PFQueryRecord mRec(ray.d, lRec.wi);
+			Color3f f = pf->eval(mRec);
+			// Area emitters are also reached by the sampled directions of the free-flight vertices
+			if (!eq.emitter->isDelta())
+				f = powerHeuristic(f, lRec.pdf * eq.pdfEmitter, scatterPdf(pf, mRec, guideAt(x)));
+			// Balance heuristic against free-flight sampling, the density of the sample cancels out
+			L += coeffs.mu_s * f / (pdfT + eq.freeFlightPdf(t, coeffs.mu_a + coeffs.mu_s));
+		}
+		return L * Le;
 	}
 
 	bool RR(const float throughputLuminance, Sampler* sampler, float& pdfRR, float maxRR=0.9f) const {
@@ -26,13 +319,13 @@ public :
 
 	Color3f mediaMIS(const Ray3f& rayPF, const Ray3f& rayNEE,
 					 const Color3f& Lpf, const Color3f& Lnee,
-					 const PhaseFunction* pf, const Ray3f& originalDir,
+					 const PhaseFunction* pf, const SDTree::Leaf* guide, const Ray3f& originalDir,
 					 float pdfNEE_NEE, float pdfPF_NEE) const {
 		// pdf of the ray [] by the [] method
 		PFQueryRecord pfQR(originalDir.d, rayPF.d);
 		PFQueryRecord neeQR(originalDir.d, rayNEE.d);
-		float pdfPF_PF = pf->pdf(pfQR);
-		float pdfNEE_PF = pf->pdf(neeQR);
+		float pdfPF_PF = scatterPdf(pf, pfQR, guide);
+		float pdfNEE_PF = scatterPdf(pf, neeQR, guide);
 
 		return powerHeuristic(Lpf, pdfPF_PF, pdfPF_NEE)
 			+ powerHeuristic(Lnee, pdfNEE_NEE, pdfNEE_PF);
@@ -56,7 +349,7 @@ public :
 
 	#define MAX_SCENE 200.0
 	// Returns the direct light of the reflected ray attenuated by the transmittance
-	Color3f sampledDirectionLight(const Scene* scene, const Ray3f& rayPF, float& pdfEm, const Emitter*& emitter) const {
+	Color3f sampledDirectionLight(const Scene* scene, Sampler* sampler, const Ray3f& rayPF, float& pdfEm, const Emitter*& emitter) const {
 		Intersection pfIt;
 		bool pfIntersected = scene->rayIntersect(rayPF, pfIt);
 		Color3f Lpf(0);
@@ -65,24 +358,42 @@ public :
 			emitter = scene->getEnvironmentalEmitter();
 			EmitterQueryRecord emitterQueryRecord;
 			emitterQueryRecord.wi = rayPF.d;
-			Lpf = scene->transmittance(rayPF.o, rayPF.o + MAX_SCENE * rayPF.d) * emitter->eval(emitterQueryRecord);
+			Lpf = scene->transmittance(rayPF.o, rayPF.o + MAX_SCENE * rayPF.d, sampler) * emitter->eval(emitterQueryRecord);
 			pdfEm = emitter->pdf(emitterQueryRecord);
 		} else if (pfIntersected && pfIt.mesh->isEmitter()) {
 			// Reflected ray intersects with emitter
 			emitter = pfIt.mesh->getEmitter();
 			EmitterQueryRecord emitterQueryRecord(emitter, rayPF.o, pfIt.p, pfIt.shFrame.n, pfIt.uv);
-			Lpf = scene->transmittance(rayPF.o, pfIt.p) * emitter->eval(emitterQueryRecord);
+			Lpf = scene->transmittance(rayPF.o, pfIt.p, sampler) * emitter->eval(emitterQueryRecord);
 			pdfEm = emitter->pdf(emitterQueryRecord);
 		}
 		return Lpf;
 	}
 
+	/// Direction sampled at a path vertex, along which the path continues
+	struct ScatterSample {
+		Ray3f ray;
+		/// Phase function or BSDF over the density of the direction
+		Color3f weight;
+		/// Density of the direction at the media vertices, the phase function mixed with the guide if any
+		float pdf;
+		/// Radiance arriving from an emitter straight along \c ray, what the guide learns on top of the rest of the path
+		Color3f Ldirect;
+	};
+
+	/// Direct light in-scattered at the media vertex \c itMedia toward \c ray, and the direction \c next the path continues along
 	Color3f InScattering(const Scene* scene, Sampler* sampler, const Ray3f& ray, const MediaIntersection& itMedia,
-						 const MediaCoeffs& coeffs) const {
-		// Next Event Estimation
+						 const MediaCoeffs& coeffs, const EquiangularSegment* eq, ScatterSample& next) const {
+		// Next Event Estimation, toward the emitter of the segment if its distances are also sampled equiangularly
 		Color3f Lnee(0);
 		float pdf_light;
-		const Emitter* emitter_nee = scene->sampleEmitter(sampler->next1D(), pdf_light);
+		const Emitter* emitter_nee;
+		if (eq) {
+			emitter_nee = eq->emitter;
+			pdf_light = eq->pdfEmitter;
+		} else {
+			emitter_nee = scene->sampleEmitter(sampler->next1D(), pdf_light);
+		}
 		EmitterQueryRecord emitterRecord(ray.o);
 		Color3f Le = emitter_nee->sample(emitterRecord, sampler->next2D(), 0);
 		bool isVisible = scene->isVisible(ray.o, emitterRecord.p);
@@ -90,40 +401,85 @@ public :
 		if (isVisible) {
 			PFQueryRecord mRec(ray.d, emitterRecord.wi);
 			// Here transmittance is accounted since we are not sampling distances wrt it
-			Lnee = Le * scene->transmittance(ray.o, emitterRecord.p)
+			Lnee = Le * scene->transmittance(ray.o, emitterRecord.p, emitter_nee, sampler)
 			       * itMedia.pMedia->getPhaseFunction()->eval(mRec)
 			       / pdf_light;
+			if (eq && eq->active && EquiangularSegment::samples(itMedia.pMedia)) {
+				// Balance heuristic against the equiangular sampling of this distance toward the same point
+				float pdfFreeFlight = eq->freeFlightPdf(itMedia.t, coeffs.mu_a + coeffs.mu_s);
+				Lnee *= pdfFreeFlight / (pdfFreeFlight + eq->pdf(itMedia.t, emitterRecord.p));
+			}
 		}
 		Ray3f rayNEE(ray.o, emitterRecord.wi);
 
-		// Phase function sampling
+		// Phase function sampling, one-sample mixture with the guide once it learned something here
+		const PhaseFunction* pf = itMedia.pMedia->getPhaseFunction();
+		const SDTree::Leaf* guide = guideAt(ray.o);
 		PFQueryRecord mRec(ray.d);
-		Color3f samplePf = itMedia.pMedia->getPhaseFunction()->sample(mRec, sampler->next2D());
+		Color3f samplePf;
+		float pdfScatter;
+		if (guide) {
+			if (sampler->next1D() < m_guideFraction) {
+				float pdfGuide;
+				mRec.wo = guide->sampling.sample(sampler->next2D(), PhaseWeight{ pf, mRec.wi }, pdfGuide);
+				pdfScatter = m_guideFraction * pdfGuide + (1.0f - m_guideFraction) * pf->pdf(mRec);
+			} else {
+				pf->sample(mRec, sampler->next2D());
+				pdfScatter = scatterPdf(pf, mRec, guide);
+			}
+			samplePf = pdfScatter > 0.0f ? pf->eval(mRec) / pdfScatter : Color3f(0.0f);
+		} else {
+			samplePf = pf->sample(mRec, sampler->next2D());
+			pdfScatter = pf->pdf(mRec);
+		}
 		Ray3f rayPF(ray.o, mRec.wo);
 		float pdf_pf_em = 0.0f;
 		const Emitter* emitter_pf = nullptr;
-		Color3f Lpf = samplePf * sampledDirectionLight(scene, rayPF, pdf_pf_em, emitter_pf);
+		Color3f Lincident = sampledDirectionLight(scene, sampler, rayPF, pdf_pf_em, emitter_pf);
+		Color3f Lpf = samplePf * Lincident;
 		pdf_pf_em *= pdf_light;
 
 		// Multiple Importance Sampling
 		Color3f Lmis(0);
 		// Different source, can add <-> same source, MIS
 		if (emitter_nee != emitter_pf || !isVisible) Lmis = Lnee + Lpf;
-		else Lmis = mediaMIS(rayPF, rayNEE, Lpf, Lnee,itMedia.pMedia->getPhaseFunction(), ray,
+		else Lmis = mediaMIS(rayPF, rayNEE, Lpf, Lnee, pf, guide, ray,
 							pnee_nee, pdf_pf_em);
 
-		Color3f Lcont = 0;
-		// If absorption do not continue the ray
-		float pdfRR;
-		if (!RR(coeffs.alpha(), sampler, pdfRR)) {
-			Lcont = samplePf * this->LiT(scene, sampler, rayPF) / pdfRR;
-		}
-
-		return Lmis + Lcont;
+		next = ScatterSample{ rayPF, samplePf, pdfScatter, Lincident };
+		return Lmis;
 	}
 
-	Color3f DirectLight(const Scene* scene, Sampler* sampler, const Ray3f& ray, const Intersection& it) const {
+	/**
+	 * \brief In-scattered light with the approximate multiple scattering of the media
+	 *
+	 * Next event estimation only, summing the octaves of the media. They
+	 * stand in for the rest of the path, which is not continued.
+	 */
+	Color3f OctaveScattering(const Scene* scene, Sampler* sampler, const Ray3f& ray, const MediaIntersection& itMedia) const {
+		const ScatteringOctaves& octaves = itMedia.pMedia->getScatteringOctaves();
+		float pdf_light;
+		const Emitter* emitter = scene->sampleEmitter(sampler->next1D(), pdf_light);
+		EmitterQueryRecord emitterRecord(ray.o);
+		Color3f Le = emitter->sample(emitterRecord, sampler->next2D(), 0);
+		if (!scene->isVisible(ray.o, emitterRecord.p)) return {0.0f};
+		// The octaves scale the optical depth itself, which a binary transmittance estimate does not carry
+		float tau = scene->opticalDepth(ray.o, emitterRecord.p, emitter, sampler);
 
+		const PhaseFunction* pf = itMedia.pMedia->getPhaseFunction();
+		PFQueryRecord mRec(ray.d, emitterRecord.wi);
+		Color3f L(0.0f);
+		float a = 1.0f, b = 1.0f, c = 1.0f;
+		for (int i = 0; i < octaves.count; i++) {
+			L += a * std::exp(-b * tau) * pf->eval(mRec, c);
+			a *= octaves.a;
+			b *= octaves.b;
+			c *= octaves.c;
+		}
+		return Le * L / pdf_light;
+	}
+	/// Direct light reflected at the surface vertex \c it toward \c ray, and the direction \c next the path continues along
+	Color3f DirectLight(const Scene* scene, Sampler* sampler, const Ray3f& ray, const Intersection& it, ScatterSample& next) const {
 		// Next event estimation
 		Color3f Lnee(0);
 		float pdf_light;
@@ -136,7 +492,7 @@ public :
 			BSDFQueryRecord bsdfRecord(it.toLocal(-ray.d), it.toLocal(emitterRecord.wi), it.uv, ESolidAngle);
 			float cs = abs(it.shFrame.n.dot(emitterRecord.wi));
 			Lnee = Le * it.mesh->getBSDF()->eval(bsdfRecord)
-					* scene->transmittance(ray.o, emitterRecord.p) * cs
+					* scene->transmittance(ray.o, emitterRecord.p, emitter_nee, sampler) * cs
 					/ pdf_light;
 		}
 		Ray3f rayNEE(ray.o, emitterRecord.wi);
@@ -147,7 +503,8 @@ public :
 		Ray3f rayBSDF(ray.o, it.toWorld(bsdfRecord.wo));
 		float pdf_pf_em = 0.0f;
 		const Emitter* emitter_pf = nullptr;
-		Color3f Lbsdf = sampleBSDF * sampledDirectionLight(scene, rayBSDF, pdf_pf_em, emitter_pf);
+		Color3f Lincident = sampledDirectionLight(scene, sampler, rayBSDF, pdf_pf_em, emitter_pf);
+		Color3f Lbsdf = sampleBSDF * Lincident;
 		pdf_pf_em *= pdf_light;
 
 		// Multiple Importance Sampling
@@ -158,69 +515,209 @@ public :
 							   it,
 		                       pnee_nee, pdf_pf_em);
 
-		// Russian roulette for termination
+		next = ScatterSample{ rayBSDF, sampleBSDF, 0.0f, Lincident };
+		return Lmis;
+	}
+
+	/**
+	 * \brief Media vertex of a pilot or guiding path, whose incident radiance
+	 * is only known once the rest of the path is traced
+	 */
+	struct RecordedVertex {
+		Point3f p;
+		ScatterSample next;
+		/// Survival probability of the Russian roulette of the continuation, 0 if the path ended there
 		float pdfRR;
-		if (RR(sampleBSDF.getLuminance(), sampler, pdfRR)) {
-			return Lmis;
-		}
+		/// Throughput of the path past the vertex, and the radiance it brought
+		Color3f throughput, Lin;
+	};
 
-		return Lmis + sampleBSDF * this->LiT(scene, sampler, rayBSDF) / pdfRR;
-	}
+	/**
+	 * \brief Radiance along the camera ray \c ray
+	 *
+	 * The path is traced in a loop carrying its throughput. Each vertex adds
+	 * its direct light, then the path scatters further, up to \ref m_maxDepth
+	 * vertices. Past \ref m_rrDepth vertices, Russian roulette on the
+	 * throughput ends it. The direct emission is only accounted for the camera
+	 * rays, deeper rays leave it to the MIS of the previous vertex. During the
+	 * pilot and guiding passes, the radiance incident on the media vertices
+	 * is recorded in \c pilot and \c training once the path ends.
+	 */
+	Color3f LiT(const Scene* scene, Sampler* sampler, Ray3f ray,
+	            RadianceCache* pilot = nullptr, SDTree* training = nullptr) const {
+		Color3f L(0.0f), throughput(1.0f);
+		std::vector<RecordedVertex> recorded;
+		// Radiance reaching the current vertex, also brought to the recorded ones
+		auto addRadiance = [&](const Color3f& Lv) {
+			L += throughput * Lv;
+			for (RecordedVertex& v : recorded)
+				v.Lin += v.throughput * Lv;
+		};
+		auto scaleThroughput = [&](const Color3f& f) {
+			throughput *= f;
+			for (RecordedVertex& v : recorded)
+				v.throughput *= f;
+		};
 
-	Color3f LiT(const Scene* scene, Sampler* sampler, const Ray3f& ray, bool first=false) const {
+		for (int depth = 0; ; ++depth) {
+			Intersection it;
+			bool intersected = scene->rayIntersect(ray, it);
+			float tmax = intersected ? it.t : ray.maxt;
 
-		Intersection it;
-		bool intersected = scene->rayIntersect(ray, it);
+			// Distances sampled toward an emitter, on top of the free-flight sampling below
+			EquiangularSegment eq;
+			bool equiangular = m_equiangular && scene->hasMedia();
+			if (equiangular) {
+				setupEquiangular(scene, sampler, ray, tmax, eq);
+				if (eq.active)
+					addRadiance(EquiangularScattering(scene, sampler, ray, eq));
+			}
 
-		// Check intersection with scene
-		std::vector<MediaBoundaries> allMediaBoundaries = scene->rayIntersectMediaBoundaries(ray);
-		MediaIntersection itMedia;
-		bool intersectedMedia = scene->rayIntersectMediaSample(ray, allMediaBoundaries, itMedia);
-		/* Base cases:
-		 * In all of these cases there are no collisions with the media. 
-		 * The probability of not colliding with the media is equals to 1-cdf.
-		 * Since 1-cdf is equals to the transmittance, the probability and the transmittance cancel out
-		 */
-		if (!intersected && !intersectedMedia && !first) {
-			// Secondary ray didn't intersect with anything
-			// Return 0 to avoid double counting of environment light
-			return {0.0f};
-		} else if (intersected && (!intersectedMedia || itMedia.t >= it.t) && it.mesh->isEmitter() && first) {
-			// Ray intersected with emitter, return
-			const Emitter* emitter = it.mesh->getEmitter();
-			EmitterQueryRecord emitterQueryRecord(emitter, ray.o, it.p, it.shFrame.n, it.uv);
-			return emitter->eval(emitterQueryRecord);
-		} else if (!intersected && !intersectedMedia && first) {
-			// First ray didn't intersect with anything, return environment
-			return scene->getBackground(ray);
-		}
+			// Check intersection with scene, mediums behind the surface are skipped
+			MediaIntersection itMedia;
+			bool intersectedMedia = scene->rayIntersectMediaSample(Ray3f(ray, ray.mint, tmax), sampler, itMedia);
+			bool surface = intersected && (!intersectedMedia || itMedia.t >= it.t);
+			/* Base cases:
+			 * In all of these cases there are no collisions with the media. 
+			 * The probability of not colliding with the media is equals to 1-cdf.
+			 * Since 1-cdf is equals to the transmittance, the probability and the transmittance cancel out
+			 */
+			if (!surface && !intersectedMedia) {
+				// Secondary rays leave the environment light to the MIS of the previous vertex
+				if (depth == 0)
+					addRadiance(scene->getBackground(ray));
+				break;
+			} else if (surface && it.mesh->isEmitter() && depth == 0) {
+				// Ray intersected with emitter
+				const Emitter* emitter = it.mesh->getEmitter();
+				EmitterQueryRecord emitterQueryRecord(emitter, ray.o, it.p, it.shFrame.n, it.uv);
+				addRadiance(emitter->eval(emitterQueryRecord));
+				break;
+			}
 
-		// Ray intersected with geometry or media
+			ScatterSample next;
+			// Weight of the collision, which does not depend on the direction sampled next
+			Color3f collision(1.0f);
+			if (surface) {
+				// pdf is 1 since sampling according to transmittance (1 - cdf = transmittance)
+				addRadiance(DirectLight(scene, sampler, Ray3f(it.p, ray.d), it, next));
+			} else {
+				// Transmittance not accounted because it gets simplified by the sampling, the remaining mu_t at xs is
+				MediaCoeffs coeffs = itMedia.pMedia->getMediaCoeffs(itMedia.p);
+				collision = Color3f(coeffs.mu_s / itMedia.pdf);
+				scaleThroughput(collision);
+				Ray3f rayMedia(itMedia.p, ray.d);
+				if (itMedia.pMedia->getScatteringOctaves().enabled()) {
+					addRadiance(OctaveScattering(scene, sampler, rayMedia, itMedia));
+					break;
+				}
+				addRadiance(InScattering(scene, sampler, rayMedia, itMedia, coeffs, equiangular ? &eq : nullptr, next));
 
-		Color3f L(0.0f);
-		float pdf = 1.0f;
-		if (intersected && (!intersectedMedia || itMedia.t >= it.t)) {
-			// Intersected with a surface
-			L = DirectLight(scene, sampler, Ray3f(it.p, ray.d), it);
-			// pdf is 1 since sampling according to transmittance
-			pdf = 1.0f; // (1 - cdf = transmittance)
-		} else {
-			// Intersected with media
-			// Transmittance not accounted because it gets simplified by the sampling (not mu_t, accounted below)
-			MediaCoeffs coeffs = itMedia.pMedia->getMediaCoeffs(itMedia.p);
-			L = coeffs.mu_s * InScattering(scene, sampler, Ray3f(itMedia.p, ray.d), itMedia, coeffs);
-			pdf = itMedia.pdf; // Transmittance simplified, remaining mu_t at xs
+				if (!pilot && m_cache.isValid() && depth >= m_cacheDepth) {
+					// Terminate the path with the cached radiance, jittered over the cell to hide the grid
+					Vector3f jitter(sampler->next1D() - 0.5f, sampler->next1D() - 0.5f, sampler->next1D() - 0.5f);
+					Color3f Lcache;
+					if (m_cache.lookup(itMedia.p + m_cache.getCellSize() * jitter, ray.d,
+					                   itMedia.pMedia->getPhaseFunction()->getMeanCosine(), m_cacheMinSamples, Lcache)) {
+						addRadiance(Lcache);
+						break;
+					}
+				}
+			}
+
+			/* Russian roulette on the throughput past the first vertices. The cache divides the
+			   radiance of the pilot media vertices by pdfRR, which neither the camera throughput
+			   nor the guided direction may make arbitrarily small, so these roulette on the collision */
+			bool continues = depth + 1 < m_maxDepth;
+			float pdfRR = 1.0f;
+			if (continues && depth + 1 >= m_rrDepth) {
+				Color3f rrWeight = !pilot ? throughput * next.weight : surface ? next.weight : collision;
+				continues = !RR(rrWeight.getLuminance(), sampler, pdfRR);
+			}
+			if (continues)
+				scaleThroughput(next.weight / pdfRR);
+			if ((pilot || training) && !surface)
+				recorded.push_back(RecordedVertex{ itMedia.p, next, continues ? pdfRR : 0.0f, Color3f(1.0f), Color3f(0.0f) });
+			if (!continues)
+				break;
+			ray = next.ray;
 		}
-		return L / pdf;
+
+		for (const RecordedVertex& v : recorded) {
+			/* Every vertex is added, the ones whose path ended with no radiance, so that the
+			   directions stay distributed by the PF density, which is bounded away from 0 so
+			   the projection stays well behaved */
+			if (pilot)
+				pilot->add(v.p, v.next.ray.d, v.pdfRR > 0.0f ? Color3f(v.Lin / v.pdfRR) : Color3f(0.0f), v.next.pdf);
+			if (training && v.next.pdf > 0.0f) {
+				Color3f Lincident = v.pdfRR > 0.0f ? v.next.Ldirect + v.Lin / v.pdfRR : v.next.Ldirect;
+				training->lookup(v.p).record(v.next.ray.d, Lincident.getLuminance() / v.next.pdf);
+			}
+		}
+		return L;
 	}
 
+
 	Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray) const {
-		return LiT(scene, sampler, ray, true);
+		return LiT(scene, sampler, ray);
 	}
 
 	std::string toString() const {
-		return "Path Tracer Integrator []" ;
+		std::string str = tfm::format(
+			"Path Tracer Integrator [\n"
+			"  max_depth = %i,\n"
+			"  rr_depth = %i,\n",
+			m_maxDepth, m_rrDepth);
+		if (m_equiangular)
+			str += "  equiangular = true,\n";
+		if (m_useCache)
+			str += tfm::format(
+				"  cache_depth = %i,\n"
+				"  cache_pilot_spp = %i,\n"
+				"  cache_min_samples = %i,\n"
+				"  cache = %s,\n",
+				m_cacheDepth, m_pilotSpp, m_cacheMinSamples, indent(m_cache.toString()));
+		if (m_useGuiding)
+			str += tfm::format(
+				"  guide_passes = %i,\n"
+				"  guide_fraction = %f,\n"
+				"  guide = %s,\n",
+				m_guidePasses, m_guideFraction, indent(m_guide.toString()));
+		// Drop the comma of the last entry
+		str.erase(str.size() - 2, 1);
+		return str + "]";
 	}
+
+private:
+	/// Vertices of the paths at most
+	int m_maxDepth;
+	/// Vertices before the Russian roulette starts
+	int m_rrDepth;
+
+	bool m_useCache;
+	/// Bounces after which the media vertices read the cache
+	int m_cacheDepth;
+	float m_cacheCellSize;
+	int m_cacheCells;
+	int m_pilotSpp;
+	int m_cacheMinSamples;
+	RadianceCache m_cache;
+
+	/// Depth of the directional quadtrees
+	static constexpr int MaxGuideDepth = 20;
+	bool m_useGuiding;
+	int m_guidePasses;
+	/// Samples per pixel of the first guiding pass
+	int m_guideSpp;
+	/// Probability of sampling the guide rather than the phase function
+	float m_guideFraction;
+	/// Records of a leaf above which it is split, scaled by the square root of the samples per pixel
+	int m_guideSpatialThreshold;
+	float m_guideDirectionalThreshold;
+	SDTree m_guide;
+
+	/// Sample the distances along the rays toward the emitters too, see \ref EquiangularSegment
+	bool m_equiangular;
 };
 
 NORI_REGISTER_CLASS(PathTracingMediaSlidesRefactor, "path_media_slides_refactor");
@@ -26,25 +26,30 @@ public:
 			float sqrTerm = (1 - g * g) / (1 - g + 2 * g * sample.x());
 			cosTheta = (1 + g * g - sqrTerm * sqrTerm) / (2 * g);
 		}
-		float theta = acos(cosTheta);
+		cosTheta = std::min(std::max(cosTheta, -1.0f), 1.0f);
+		float sinTheta = std::sqrt(1.0f - cosTheta * cosTheta);
 		float phi = 2 * M_PI * sample.y();
 
 		Frame fr(mRec.wi);
-		Vector3f localWo(sin(theta) * cos(phi), sin(theta) * sin(phi), cos(theta));
+		Vector3f localWo(sinTheta * std::cos(phi), sinTheta * std::sin(phi), cosTheta);
 		mRec.wo = fr.toWorld(localWo);
 		return {1.0f};
 	}
 
 	Color3f eval(const PFQueryRecord &mRec) const override {
-		float cosTheta = mRec.wi.dot(mRec.wo);
-		return (1.0f/(4.0f*M_PI)) * (1.0f - g*g)/pow(1.0f + g*g - 2.0f*g*cosTheta, 1.5);
+		return henyeyGreenstein(g, mRec.wi.dot(mRec.wo));
+	}
+
+	Color3f eval(const PFQueryRecord &mRec, float anisotropyScale) const override {
+		return henyeyGreenstein(g * anisotropyScale, mRec.wi.dot(mRec.wo));
 	}
 
 	float pdf(const PFQueryRecord &mRec) const override {
-		float cosTheta = mRec.wi.dot(mRec.wo);
-		return (1.0f/(4.0f*M_PI)) * (1.0f - g*g)/pow(1.0f + g*g - 2.0f*g*cosTheta, 1.5);
+		return henyeyGreenstein(g, mRec.wi.dot(mRec.wo));
 	}
 
+	float getMeanCosine() const override { return g; }
+
 	std::string toString() const override {
 		return tfm::format(
 				"HenyeyGreenstein[\n"
@@ -0,0 +1,463 @@
+#include <nori/integrator.h>
+#include <nori/scene.h>
+#include <nori/emitter.h>
+#include <nori/bsdf.h>
+#include <nori/phasefunction.h>
+#include <nori/camera.h>
+#include <nori/block.h>
+#include <nori/sampler.h>
+#include <nori/timer.h>
+#include <nori/warp.h>
+#include <nori/bvhbuild.h>
+#include <nori/dpdf.h>
+
+NORI_NAMESPACE_BEGIN
+
+/// Segment of a light path inside the media, up to its next collision
+struct PhotonBeam {
+	Point3f o;
+	Vector3f d;
+	float length;
+	/// Radius of the kernel, set by the pass that traced the beam
+	float radius;
+	/// Power carried along the whole beam
+	Color3f power;
+
+	PhotonBeam(const Point3f& o, const Vector3f& d, float length, float radius, const Color3f& power)
+		: o(o), d(d), length(length), radius(radius), power(power) {}
+
+	BoundingBox3f getBoundingBox() const {
+		BoundingBox3f bbox(o);
+		bbox.expandBy(o + length * d);
+		bbox.min.array() -= radius;
+		bbox.max.array() += radius;
+		return bbox;
+	}
+
+	/**
+	 * \brief Closest approach of \c ray to the beam, if it is within the radius
+	 *
+	 * \param t
+	 *	 Distance along the ray of the closest point
+	 * \param sinTheta
+	 *	 Sine of the angle between the ray and the beam
+	 */
+	bool intersect(const Ray3f& ray, float& t, float& sinTheta) const {
+		Vector3f w0 = ray.o - o;
+		float b = ray.d.dot(d), dw = ray.d.dot(w0), e = d.dot(w0);
+		float sin2 = 1.0f - b * b;
+		// Nearly parallel, the kernel blows up anyway
+		if (sin2 < 1e-4f)
+			return false;
+		t = (b * e - dw) / sin2;
+		float s = (e - b * dw) / sin2;
+		if (t < ray.mint || t > ray.maxt || s < 0.0f || s > length)
+			return false;
+		if ((ray(t) - (o + s * d)).squaredNorm() > radius * radius)
+			return false;
+		sinTheta = std::sqrt(sin2);
+		return true;
+	}
+};
+
+/// BVH over the photon beams, built with the SAH builder of \ref Accel
+class BeamAccel {
+	template <typename Tree> friend class BVHBuildTask;
+	template <typename Tree> friend float buildBVH(Tree &bvh, n_UINT size, const BoundingBox3f &bbox);
+public:
+	/// Build the BVH over \c beams, returns its SAH cost
+	float build(std::vector<PhotonBeam>&& beams) {
+		m_beams = std::move(beams);
+		m_nodes.clear();
+		m_indices.clear();
+		m_bbox.reset();
+		if (m_beams.empty())
+			return 0.0f;
+		for (const PhotonBeam& beam : m_beams)
+			m_bbox.expandBy(beam.getBoundingBox());
+		return buildBVH(*this, (n_UINT) m_beams.size(), m_bbox);
+	}
+
+	/// Call \c f on the beams whose bounds overlap the segment of \c ray
+	template <typename F> void query(const Ray3f& ray, F f) const {
+		if (m_nodes.empty())
+			return;
+		n_UINT node_idx = 0, stack_idx = 0, stack[64];
+		while (true) {
+			const BVHNode& node = m_nodes[node_idx];
+			if (!node.bbox.rayIntersect(ray)) {
+				if (stack_idx == 0)
+					break;
+				node_idx = stack[--stack_idx];
+				continue;
+			}
+			if (node.isInner()) {
+				stack[stack_idx++] = node.inner.rightChild;
+				node_idx++;
+				assert(stack_idx < 64);
+			} else {
+				for (n_UINT i = node.start(), end = node.end(); i < end; ++i)
+					f(m_beams[m_indices[i]]);
+				if (stack_idx == 0)
+					break;
+				node_idx = stack[--stack_idx];
+			}
+		}
+	}
+
+	size_t getBeamCount() const { return m_beams.size(); }
+
+	size_t getMemoryUsage() const {
+		return m_beams.size() * sizeof(PhotonBeam) + m_nodes.size() * sizeof(BVHNode) + m_indices.size() * sizeof(n_UINT);
+	}
+
+protected:
+	BoundingBox3f getBoundingBox(n_UINT index) const { return m_beams[index].getBoundingBox(); }
+
+	Point3f getCentroid(n_UINT index) const { return m_beams[index].o + 0.5f * m_beams[index].length * m_beams[index].d; }
+
+private:
+	std::vector<PhotonBeam> m_beams;
+	std::vector<BVHNode> m_nodes;
+	std::vector<n_UINT> m_indices;
+	BoundingBox3f m_bbox;
+};
+
+/**
+ * \brief Volumetric photon beams (Jarosz et al. 2011)
+ *
+ * Light paths traced from the emitters leave short beams in the media,
+ * ending at their next collision, which are gathered along the camera
+ * rays with a 1D box kernel. Surfaces only get direct lighting. With more
+ * than one pass, each pass traces new beams with a smaller radius, as in
+ * progressive photon beams, and the passes are averaged.
+ *
+ * The light paths leave the point and area lights, and the environment
+ * through a disk facing the scene, in directions importance sampled from a
+ * table of its radiance. Other emitters only light the surfaces.
+ */
+class PhotonBeams : public Integrator {
+public:
+	PhotonBeams(const PropertyList &props) {
+		m_pathCount = props.getInteger("beam_count", 10000);
+		m_passes = props.getInteger("passes", 1);
+		m_radius = props.getFloat("radius", 0.0f);
+		m_alpha = props.getFloat("alpha", 0.7f);
+		m_maxDepth = props.getInteger("max_depth", 32);
+		if (m_pathCount <= 0 || m_passes <= 0 || m_radius < 0.0f || m_maxDepth <= 0)
+			throw NoriException("PhotonBeams: invalid parameters");
+		if (m_alpha <= 0.0f || m_alpha >= 1.0f)
+			throw NoriException("PhotonBeams: alpha must be in (0, 1)");
+	}
+
+	/// Trace the beams of all the passes in parallel and build their BVH
+	void preprocess(const Scene* scene) override {
+		m_mediaBounds.reset();
+		for (const PMedia* media : scene->getMedia())
+			m_mediaBounds.expandBy(media->getBoundingBox());
+		if (!m_mediaBounds.isValid())
+			return;
+		m_sceneBounds = m_mediaBounds;
+		if (scene->getBoundingBox().isValid())
+			m_sceneBounds.expandBy(scene->getBoundingBox());
+
+		m_photonEmitters.clear();
+		for (const Emitter* emitter : scene->getLights()) {
+			EmitterType type = emitter->getEmitterType();
+			if (type == EmitterType::EMITTER_ENVIRONMENT)
+				buildEnvironmentTable(emitter);
+			if (type == EmitterType::EMITTER_POINT || type == EmitterType::EMITTER_AREA || type == EmitterType::EMITTER_ENVIRONMENT)
+				m_photonEmitters.push_back(emitter);
+			else
+				cout << "Warning: PhotonBeams: an emitter cannot trace light paths, it does not light the media" << endl;
+		}
+		if (m_photonEmitters.empty())
+			throw NoriException("PhotonBeams: the media are lit by no emitter that can trace light paths");
+		if (m_radius == 0.0f)
+			m_radius = m_mediaBounds.getExtents().norm() / 200.0f;
+
+		cout << "Tracing photon beams (" << m_passes << (m_passes == 1 ? " pass, " : " passes, ")
+			<< m_pathCount << " light paths each) .. ";
+		cout.flush();
+		Timer timer;
+
+		/* Progressive radius reduction: R_{i+1} = R_i (i + alpha) / (i + 1) */
+		std::vector<float> radii(m_passes, m_radius);
+		for (int i = 1; i < m_passes; ++i)
+			radii[i] = radii[i - 1] * (i + m_alpha) / (i + 1);
+
+		/* Each chunk of paths gets its own sampler and output, so that the
+		   beams do not depend on the number of threads */
+		const int chunkSize = 256;
+		int chunksPerPass = (m_pathCount + chunkSize - 1) / chunkSize;
+		std::vector<std::vector<PhotonBeam>> chunks(m_passes * chunksPerPass);
+		const Camera* camera = scene->getCamera();
+		tbb::parallel_for(tbb::blocked_range<int>(0, (int) chunks.size()), [&](const tbb::blocked_range<int>& range) {
+			ImageBlock block(Vector2i(1), camera->getReconstructionFilter());
+			std::unique_ptr<Sampler> sampler(scene->getSampler()->clone());
+			for (int c = range.begin(); c < range.end(); ++c) {
+				int pass = c / chunksPerPass, first = (c % chunksPerPass) * chunkSize;
+				// Negative rows never collide with the seeds of the image blocks
+				block.setOffset(Point2i(c % chunksPerPass, -1 - pass));
+				sampler->prepare(block);
+				float scale = 1.0f / ((float) m_pathCount * m_passes);
+				for (int i = first; i < std::min(first + chunkSize, m_pathCount); ++i)
+					tracePath(scene, sampler.get(), radii[pass], scale, chunks[c]);
+			}
+		});
+		std::vector<PhotonBeam> beams;
+		size_t count = 0;
+		for (const std::vector<PhotonBeam>& chunk : chunks)
+			count += chunk.size();
+		beams.reserve(count);
+		for (const std::vector<PhotonBeam>& chunk : chunks)
+			beams.insert(beams.end(), chunk.begin(), chunk.end());
+		cout << "done (took " << timer.elapsedString() << ", " << count << " beams)." << endl;
+
+		cout << "Constructing the beam BVH .. ";
+		cout.flush();
+		timer.reset();
+		float sahCost = m_beams.build(std::move(beams));
+		cout << "done (took " << timer.elapsedString() << " and " << memString(m_beams.getMemoryUsage())
+			<< ", SAH cost = " << sahCost << ")." << endl;
+	}
+
+	Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& _ray) const override {
+		Intersection its;
+		bool intersected = scene->rayIntersect(_ray, its);
+		Ray3f ray(_ray, _ray.mint, intersected ? its.t : _ray.maxt);
+
+		MediaBoundariesList medBounds;
+		scene->rayIntersectMediaBoundaries(ray, medBounds);
+
+		/* Gather the beams, then attenuate them front to back */
+		static thread_local std::vector<std::pair<float, Color3f>> hits;
+		hits.clear();
+		if (!medBounds.empty()) {
+			m_beams.query(ray, [&](const PhotonBeam& beam) {
+				float t, sinTheta;
+				if (!beam.intersect(ray, t, sinTheta))
+					return;
+				Point3f x = ray(t);
+				Color3f scattering(0.0f);
+				PFQueryRecord mRec(beam.d, -ray.d);
+				for (const MediaBoundaries& medBound : medBounds)
+					if (medBound.contains(t))
+						scattering += medBound.pMedia->getMediaCoeffs(x).mu_s * medBound.pMedia->getPhaseFunction()->eval(mRec);
+				if (scattering.maxCoeff() > 0.0f)
+					hits.emplace_back(t, beam.power * scattering / (2.0f * beam.radius * sinTheta));
+			});
+			std::sort(hits.begin(), hits.end(),
+				[](const std::pair<float, Color3f>& a, const std::pair<float, Color3f>& b) { return a.first < b.first; });
+		}
+
+		Color3f L(0.0f);
+		float T = 1.0f, tPrev = 0.0f;
+		for (const std::pair<float, Color3f>& hit : hits) {
+			T *= transmittance(scene, sampler, ray, medBounds, tPrev, hit.first);
+			tPrev = hit.first;
+			if (T <= 0.0f)
+				return L;
+			L += T * hit.second;
+		}
+
+		if (!intersected) {
+			float tFar = tPrev;
+			for (const MediaBoundaries& medBound : medBounds)
+				tFar = std::max(tFar, medBound.tOut);
+			return L + T * transmittance(scene, sampler, ray, medBounds, tPrev, tFar) * scene->getBackground(ray);
+		}
+		T *= transmittance(scene, sampler, ray, medBounds, tPrev, its.t);
+		if (T <= 0.0f)
+			return L;
+		if (its.mesh->isEmitter()) {
+			const Emitter* emitter = its.mesh->getEmitter();
+			L += T * emitter->eval(EmitterQueryRecord(emitter, ray.o, its.p, its.shFrame.n, its.uv));
+		}
+		return L + T * directLight(scene, sampler, ray, its);
+	}
+
+	std::string toString() const override {
+		return tfm::format(
+			"PhotonBeams[\n"
+			"  beam_count = %i,\n"
+			"  passes = %i,\n"
+			"  radius = %f,\n"
+			"  alpha = %f,\n"
+			"  max_depth = %i\n"
+			"]",
+			m_pathCount, m_passes, m_radius, m_alpha, m_maxDepth);
+	}
+
+private:
+	/// Trace a light path, storing its beams scaled by \c scale
+	void tracePath(const Scene* scene, Sampler* sampler, float radius, float scale, std::vector<PhotonBeam>& beams) const {
+		// Uniformly among the emitters tracing light paths
+		size_t count = m_photonEmitters.size();
+		const Emitter* emitter = m_photonEmitters[std::min((size_t) (sampler->next1D() * count), count - 1)];
+		Point2f posSample = sampler->next2D();
+		Point2f dirSample = sampler->next2D();
+		Ray3f ray;
+		Color3f power = emitter->getEmitterType() == EmitterType::EMITTER_ENVIRONMENT
+			? sampleEnvironmentPhoton(emitter, posSample, dirSample, ray)
+			: emitter->samplePhoton(ray, posSample, dirSample);
+		power *= scale * (float) count;
+
+		for (int depth = 0; depth < m_maxDepth && power.maxCoeff() > 0.0f; ++depth) {
+			Intersection its;
+			bool intersected = scene->rayIntersect(ray, its);
+			float tEnd = intersected ? its.t : ray.maxt;
+			MediaIntersection medIts;
+			bool collided = scene->rayIntersectMediaSample(Ray3f(ray, ray.mint, tEnd), sampler, medIts);
+
+			/* The beam stops at the collision, whose probability to lie
+			   past a point is the transmittance up to it */
+			float nearT, farT;
+			if (m_mediaBounds.rayIntersect(ray, nearT, farT)) {
+				float t0 = std::max(nearT, 0.0f), t1 = std::min(farT, collided ? medIts.t : tEnd);
+				/* Long beams are split, so that their bounds stay tight in the BVH.
+				   The closest point to a camera ray lies in one of the pieces only */
+				float pieceLength = SplitLength * radius;
+				for (; t1 - t0 > pieceLength; t0 += pieceLength)
+					beams.emplace_back(ray(t0), ray.d, pieceLength, radius, power);
+				if (t1 > t0)
+					beams.emplace_back(ray(t0), ray.d, t1 - t0, radius, power);
+			}
+
+			if (collided) {
+				// Scatter with probability mu_s / mu_t, which leaves the power unchanged
+				MediaCoeffs coeffs = medIts.pMedia->getMediaCoeffs(medIts.p);
+				if (sampler->next1D() >= coeffs.mu_s / medIts.pdf)
+					break;
+				PFQueryRecord mRec(ray.d);
+				power *= medIts.pMedia->getPhaseFunction()->sample(mRec, sampler->next2D());
+				ray = Ray3f(medIts.p, mRec.wo);
+			} else if (intersected && its.mesh->getBSDF()) {
+				BSDFQueryRecord bRec(its.toLocal(-ray.d), its.uv);
+				Color3f f = its.mesh->getBSDF()->sample(bRec, sampler->next2D());
+				float q = std::min(f.maxCoeff(), 0.95f);
+				if (q <= 0.0f || sampler->next1D() >= q)
+					break;
+				power *= f / q;
+				ray = Ray3f(its.p, its.toWorld(bRec.wo));
+			} else
+				break;
+		}
+	}
+
+	/// Direction toward the environment at the spherical coordinates of its map
+	static Vector3f environmentDirection(float phi, float cosTheta) {
+		float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+		return Vector3f(sinTheta * std::cos(phi), cosTheta, sinTheta * std::sin(phi));
+	}
+
+	/**
+	 * \brief Tabulates the luminance of the environment over a grid of its directions
+	 *
+	 * Each cell is picked by its luminance at the center, plus a tenth of the
+	 * mean, so that no direction the environment lights is left out.
+	 */
+	void buildEnvironmentTable(const Emitter* emitter) {
+		std::vector<float> luminance(EnvPhiCells * EnvThetaCells);
+		float mean = 0.0f, totalSolidAngle = 0.0f;
+		for (int j = 0; j < EnvThetaCells; ++j) {
+			float cos0 = std::cos(M_PI * j / EnvThetaCells), cos1 = std::cos(M_PI * (j + 1) / EnvThetaCells);
+			float solidAngle = 2.0f * M_PI / EnvPhiCells * (cos0 - cos1);
+			for (int i = 0; i < EnvPhiCells; ++i) {
+				EmitterQueryRecord lRec(m_sceneBounds.getCenter());
+				lRec.wi = environmentDirection(2.0f * M_PI * (i + 0.5f) / EnvPhiCells, 0.5f * (cos0 + cos1));
+				float lum = std::max(0.0f, emitter->eval(lRec).getLuminance());
+				luminance[j * EnvPhiCells + i] = lum;
+				mean += lum * solidAngle;
+				totalSolidAngle += solidAngle;
+			}
+		}
+		mean /= totalSolidAngle;
+		m_envCells.clear();
+		m_envCells.reserve(luminance.size());
+		for (int j = 0; j < EnvThetaCells; ++j) {
+			float cos0 = std::cos(M_PI * j / EnvThetaCells), cos1 = std::cos(M_PI * (j + 1) / EnvThetaCells);
+			for (int i = 0; i < EnvPhiCells; ++i)
+				m_envCells.append((luminance[j * EnvPhiCells + i] + 0.1f * mean + 1e-6f) * (cos0 - cos1));
+		}
+		m_envCells.normalize();
+	}
+
+	/**
+	 * \brief Ray entering the scene from the environment, as \ref Emitter::samplePhoton()
+	 *
+	 * The direction is sampled from the table of the environment, uniformly
+	 * in solid angle inside its cell, the origin uniformly on the disk of the
+	 * sphere bounding the scene that faces it.
+	 */
+	Color3f sampleEnvironmentPhoton(const Emitter* emitter, const Point2f& posSample, const Point2f& dirSample, Ray3f& ray) const {
+		Point3f center = m_sceneBounds.getCenter();
+		float radius = 0.5f * m_sceneBounds.getExtents().norm();
+		float u = dirSample.x(), pdfCell;
+		size_t cell = m_envCells.sampleReuse(u, pdfCell);
+		int i = (int) (cell % EnvPhiCells), j = (int) (cell / EnvPhiCells);
+		float cos0 = std::cos(M_PI * j / EnvThetaCells), cos1 = std::cos(M_PI * (j + 1) / EnvThetaCells);
+		float solidAngle = 2.0f * M_PI / EnvPhiCells * (cos0 - cos1);
+		EmitterQueryRecord lRec(center);
+		lRec.wi = environmentDirection(2.0f * M_PI * (i + u) / EnvPhiCells, cos0 + dirSample.y() * (cos1 - cos0));
+		Color3f Le = emitter->eval(lRec) * solidAngle / pdfCell;
+		Frame frame(lRec.wi);
+		Point2f disk = Warp::squareToUniformDisk(posSample);
+		ray = Ray3f(center + radius * (lRec.wi + disk.x() * frame.s + disk.y() * frame.t), -lRec.wi);
+		return Le * M_PI * radius * radius;
+	}
+
+	/// Transmittance between the distances \c t0 and \c t1 along \c ray
+	static float transmittance(const Scene* scene, Sampler* sampler, const Ray3f& ray,
+	                           const MediaBoundariesList& medBounds, float t0, float t1) {
+		if (t1 <= t0 || medBounds.empty())
+			return 1.0f;
+		MediaBoundariesList rest;
+		for (const MediaBoundaries& medBound : medBounds) {
+			MediaBoundaries shifted = medBound.from(t0);
+			if (shifted.intervalCount > 0)
+				rest.insert(shifted);
+		}
+		return scene->transmittance(ray(t0), ray(t1), rest, sampler);
+	}
+
+	/// Next event estimation at a surface
+	static Color3f directLight(const Scene* scene, Sampler* sampler, const Ray3f& ray, const Intersection& its) {
+		const BSDF* bsdf = its.mesh->getBSDF();
+		if (!bsdf)
+			return {0.0f};
+		float pdfLight;
+		const Emitter* emitter = scene->sampleEmitter(sampler->next1D(), pdfLight);
+		EmitterQueryRecord emitterRecord(its.p);
+		Color3f Le = emitter->sample(emitterRecord, sampler->next2D(), 0);
+		if (Le.maxCoeff() <= 0.0f || !scene->isVisible(its.p, emitterRecord.p))
+			return {0.0f};
+		BSDFQueryRecord bRec(its.toLocal(-ray.d), its.toLocal(emitterRecord.wi), its.uv, ESolidAngle);
+		return Le * bsdf->eval(bRec) * std::abs(its.shFrame.n.dot(emitterRecord.wi))
+			* scene->transmittance(its.p, emitterRecord.p, emitter, sampler) / pdfLight;
+	}
+
+	/// Beams are split in pieces of at most this many radii
+	static constexpr float SplitLength = 8.0f;
+	/// Resolution of the table the environment photons are sampled from
+	enum { EnvPhiCells = 256, EnvThetaCells = 128 };
+
+	int m_pathCount;
+	int m_passes;
+	/// Radius of the first pass
+	float m_radius;
+	/// Radius reduction of the progressive passes
+	float m_alpha;
+	int m_maxDepth;
+	BoundingBox3f m_mediaBounds;
+	/// Bounds of the media and the surfaces, crossed by the light paths of the environment
+	BoundingBox3f m_sceneBounds;
+	/// Emitters the light paths leave from
+	std::vector<const Emitter*> m_photonEmitters;
+	/// Probabilities of the cells of the environment, row by row in theta
+	DiscretePDF m_envCells;
+	BeamAccel m_beams;
+};
+
+NORI_REGISTER_CLASS(PhotonBeams, "photon_beams");
+NORI_NAMESPACE_END
@@ -3,6 +3,7 @@
 //
 
 #include <nori/emitter.h>
+#include <nori/warp.h>
 
 NORI_NAMESPACE_BEGIN
 
@@ -41,6 +42,12 @@ public:
 		return 1.;
 	}
 
+	virtual Color3f samplePhoton(Ray3f& ray, const Point2f& posSample, const Point2f& dirSample) const {
+		ray = Ray3f(m_position, Warp::squareToUniformSphere(dirSample));
+		// m_radiance is the intensity, the power is 4 pi times it
+		return m_radiance / Warp::squareToUniformSpherePdf(ray.d);
+	}
+
 	float getLuminance() const {
 		return 0.2126*m_radiance.r() + 0.7152*m_radiance.g() + 0.0722*m_radiance.b();
 	}
@@ -0,0 +1,141 @@
+#include <nori/radiancecache.h>
+
+NORI_NAMESPACE_BEGIN
+
+/// Probes before a sample is dropped
+static constexpr int MaxProbes = 32;
+/// Real spherical harmonics up to order 2 evaluated at \c w
+static void evalSH(const Vector3f& w, float* sh) {
+	const float x = w.x(), y = w.y(), z = w.z();
+	sh[0] = 0.282095f;
+	sh[1] = 0.488603f * y;
+	sh[2] = 0.488603f * z;
+	sh[3] = 0.488603f * x;
+	sh[4] = 1.092548f * x * y;
+	sh[5] = 1.092548f * y * z;
+	sh[6] = 0.315392f * (3.0f * z * z - 1.0f);
+	sh[7] = 1.092548f * x * z;
+	sh[8] = 0.546274f * (x * x - y * y);
+}
+
+static void atomicAdd(std::atomic<float>& a, float v) {
+	float old = a.load(std::memory_order_relaxed);
+	while (!a.compare_exchange_weak(old, old + v, std::memory_order_relaxed)) ;
+}
+
+void RadianceCache::configure(const BoundingBox3f& bounds, float cellSize, size_t capacity) {
+	if (cellSize <= 0.0f)
+		throw NoriException("RadianceCache: the cell size must be positive");
+	m_bounds = bounds;
+	m_cellSize = cellSize;
+	m_invCellSize = 1.0f / cellSize;
+	if ((bounds.getExtents() * m_invCellSize).maxCoeff() >= (float) ((1 << 21) - 1))
+		throw NoriException("RadianceCache: the cells are too small for the bounds of the media");
+	m_capacity = 1;
+	while (m_capacity < capacity)
+		m_capacity <<= 1;
+	m_cells.reset(new Cell[m_capacity]);
+	for (size_t i = 0; i < m_capacity; ++i) {
+		m_cells[i].key.store(0, std::memory_order_relaxed);
+		m_cells[i].count.store(0, std::memory_order_relaxed);
+		for (std::atomic<float>& c : m_cells[i].sh)
+			c.store(0.0f, std::memory_order_relaxed);
+	}
+	m_dropped = 0;
+}
+
+uint64_t RadianceCache::key(const Point3f& p) const {
+	if (!m_bounds.contains(p))
+		return 0;
+	Vector3f rel = (p - m_bounds.min) * m_invCellSize;
+	// Coordinates are offset by one so that no cell has the key 0
+	return ((uint64_t) rel.x() + 1) | (((uint64_t) rel.y() + 1) << 21) | (((uint64_t) rel.z() + 1) << 42);
+}
+
+int64_t RadianceCache::find(uint64_t key, bool insert) const {
+	// Finalizer of MurmurHash3
+	uint64_t h = key;
+	h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	for (int i = 0; i < MaxProbes; ++i) {
+		size_t slot = (size_t) (h + i) & (m_capacity - 1);
+		uint64_t current = m_cells[slot].key.load(std::memory_order_acquire);
+		if (current == key)
+			return (int64_t) slot;
+		if (current == 0) {
+			if (!insert)
+				return -1;
+			// Another thread may claim the slot first, possibly for the same cell
+			if (m_cells[slot].key.compare_exchange_strong(current, key, std::memory_order_acq_rel) || current == key)
+				return (int64_t) slot;
+		}
+	}
+	return -1;
+}
+
+void RadianceCache::add(const Point3f& p, const Vector3f& w, const Color3f& L, float pdf) {
+	uint64_t k = key(p);
+	if (k == 0 || pdf <= 0.0f || !L.isValid())
+		return;
+	int64_t slot = find(k, true);
+	if (slot < 0) {
+		m_dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	Cell& cell = m_cells[slot];
+	// Monte Carlo projection
+	float basis[SHCount];
+	evalSH(w, basis);
+	for (int c = 0; c < 3; ++c)
+		for (int i = 0; i < SHCount; ++i)
+			atomicAdd(cell.sh[SHCount * c + i], L[c] * basis[i] / pdf);
+	cell.count.fetch_add(1, std::memory_order_release);
+}
+
+bool RadianceCache::lookup(const Point3f& p, const Vector3f& d, float g, uint32_t minSamples, Color3f& L) const {
+	uint64_t k = key(p);
+	if (k == 0)
+		return false;
+	int64_t slot = find(k, false);
+	if (slot < 0)
+		return false;
+	const Cell& cell = m_cells[slot];
+	uint32_t count = cell.count.load(std::memory_order_acquire);
+	if (count < minSamples || count == 0)
+		return false;
+	/* Funk-Hecke: the convolution with the phase function scales the band l
+	   by its l-th Legendre moment, taken as g^l as for Henyey-Greenstein */
+	float basis[SHCount];
+	evalSH(d, basis);
+	for (int i = 1; i < SHCount; ++i)
+		basis[i] *= i < 4 ? g : g * g;
+	for (int c = 0; c < 3; ++c) {
+		float v = 0.0f;
+		for (int i = 0; i < SHCount; ++i)
+			v += cell.sh[SHCount * c + i].load(std::memory_order_relaxed) * basis[i];
+		L[c] = std::max(0.0f, v / count);
+	}
+	return true;
+}
+
+size_t RadianceCache::getUsedCells() const {
+	size_t used = 0;
+	for (size_t i = 0; i < m_capacity; ++i)
+		if (m_cells[i].count.load(std::memory_order_relaxed) > 0)
+			++used;
+	return used;
+}
+
+std::string RadianceCache::toString() const {
+	return tfm::format(
+		"RadianceCache[\n"
+		"  cellSize = %f,\n"
+		"  capacity = %i,\n"
+		"  usedCells = %i,\n"
+		"  dropped = %i\n"
+		"]",
+		m_cellSize, m_capacity, isValid() ? getUsedCells() : 0, m_dropped.load());
+}
+
+NORI_NAMESPACE_END
@@ -50,6 +50,9 @@ void Scene::activate() {
 			m_emitters.push_back(m_meshes[i]->getEmitter());
 
 	m_accel->build();
+	m_mediaAccel.build(m_medias);
+	for (PMedia* media : m_medias)
+		media->cacheLightTransmittance(m_emitters);
 
 	if (!m_integrator)
 		throw NoriException("No integrator was specified!");
@@ -95,23 +98,34 @@ bool Scene::isVisible(const Vector3f& ref, const Vector3f& p) const {
 	return !(this->rayIntersect(sray, it_shadow) && it_shadow.t < (t- 1.e-5));
 }
 
-std::vector<MediaBoundaries> Scene::rayIntersectMediaBoundaries(const Ray3f& ray) const {
-	std::vector<MediaBoundaries> allMediaBoundaries;
-	for (const PMedia* media : m_medias) {
+void Scene::setTime(float time) {
+	for (PMedia* media : m_medias)
+		media->setTime(time);
+}
+
+void Scene::rayIntersectMediaBoundaries(const Ray3f& ray, MediaBoundariesList& allMediaBoundaries) const {
+	allMediaBoundaries.clear();
+	// A medium holding ray(maxt) is only left past it, so its crossings are found on the whole ray
+	Ray3f fullRay(ray.o, ray.d);
+	m_mediaAccel.traverse(ray, [&](const PMedia* media, float tEntry) {
 		MediaBoundaries currMedBound;
-		if (media->rayIntersectBoundaries(ray, currMedBound)) {
-			allMediaBoundaries.push_back(currMedBound);
+		if (media->rayIntersectBoundaries(fullRay, currMedBound)) {
+			currMedBound = currMedBound.upTo(ray.maxt);
+			if (currMedBound.intersected)
+				allMediaBoundaries.insert(currMedBound);
 		}
-	}
-	return allMediaBoundaries;
+		return INFINITY;
+	});
 }
 
-bool Scene::rayIntersectMediaSample(const Ray3f& ray, const std::vector<MediaBoundaries>& allMediaBoundaries, MediaIntersection& medIts) const {
+bool Scene::rayIntersectMediaSample(const Ray3f& ray, const MediaBoundariesList& allMediaBoundaries, Sampler* sampler, MediaIntersection& medIts) const {
 	bool hasIntersected = false;
 	float closestT = INFINITY;
 	for (const MediaBoundaries& mediaBound : allMediaBoundaries) {
+		// The rest of the mediums start past the closest collision
+		if (hasIntersected && mediaBound.tBoundary >= closestT) break;
 		MediaIntersection currMedIts;
-		if (mediaBound.pMedia->rayIntersectSample(ray, mediaBound, m_sampler, currMedIts) &&
+		if (mediaBound.pMedia->rayIntersectSample(ray, mediaBound, sampler, currMedIts) &&
 				(!hasIntersected || currMedIts.t < closestT)) {
 			hasIntersected = true;
 			closestT = currMedIts.t;
@@ -121,29 +135,87 @@ bool Scene::rayIntersectMediaSample(const Ray3f& ray, const std::vector<MediaBou
 	return hasIntersected;
 }
 
+bool Scene::rayIntersectMediaSample(const Ray3f& ray, Sampler* sampler, MediaIntersection& medIts) const {
+	bool hasIntersected = false;
+	float closestT = ray.maxt;
+	// Boundaries are found on the whole ray, the segment only prunes the traversal
+	Ray3f fullRay(ray.o, ray.d);
+	m_mediaAccel.traverse(ray, [&](const PMedia* media, float tEntry) {
+		MediaBoundaries mediaBound;
+		MediaIntersection currMedIts;
+		if (media->rayIntersectBoundaries(fullRay, mediaBound) &&
+				media->rayIntersectSample(fullRay, mediaBound, sampler, currMedIts) &&
+				currMedIts.t < closestT) {
+			hasIntersected = true;
+			closestT = currMedIts.t;
+			medIts = currMedIts;
+		}
+		return closestT;
+	});
+	return hasIntersected;
+}
+
 
-float Scene::transmittance(const Point3f& x0, const Point3f& xz, const std::vector<MediaBoundaries>& medBounds, const MediaIntersection& medIt) const {
+float Scene::transmittance(const Point3f& x0, const Point3f& xz, const MediaBoundariesList& medBounds, const MediaIntersection& medIt, Sampler* sampler) const {
 	float T = 1.0f;
 	for (const MediaBoundaries& medBound : medBounds) {
 		if (medBound.pMedia != medIt.pMedia) {
-			T *= medBound.pMedia->transmittance(x0, xz, medBound, m_sampler);
+			T *= medBound.pMedia->transmittance(x0, xz, medBound, sampler);
+			if (T <= 0.0f) break;
 		}
 	}
 	return T;
 }
 
 
-float Scene::transmittance(const Point3f& x0, const Point3f& xz, const std::vector<MediaBoundaries>& medBounds) const {
+float Scene::transmittance(const Point3f& x0, const Point3f& xz, const MediaBoundariesList& medBounds, Sampler* sampler) const {
 	float T = 1.0f;
 	for (const MediaBoundaries& medBound : medBounds) {
-		T *= medBound.pMedia->transmittance(x0, xz, medBound, m_sampler);
+		T *= medBound.pMedia->transmittance(x0, xz, medBound, sampler);
+		if (T <= 0.0f) break;
 	}
 	return T;
 }
 
-float Scene::transmittance(const Point3f& x0, const Point3f& xz) const {
-	std::vector<MediaBoundaries> medBounds = this->rayIntersectMediaBoundaries(Ray3f(x0, (xz - x0).normalized()));
-	return transmittance(x0, xz, medBounds);
+float Scene::transmittance(const Point3f& x0, const Point3f& xz, Sampler* sampler) const {
+	if (!hasMedia()) return 1.0f;
+	float T = 1.0f;
+	Ray3f ray(x0, (xz - x0).normalized());
+	// Only the mediums whose bounds overlap the segment are visited
+	m_mediaAccel.traverse(Ray3f(ray, ray.mint, (xz - x0).norm()), [&](const PMedia* media, float tEntry) {
+		MediaBoundaries medBound;
+		if (media->rayIntersectBoundaries(ray, medBound))
+			T *= media->transmittance(x0, xz, medBound, sampler);
+		// Stops the traversal once the path is blocked
+		return T > 0.0f ? INFINITY : -INFINITY;
+	});
+	return T;
+}
+
+float Scene::transmittance(const Point3f& x0, const Point3f& xz, const Emitter* emitter, Sampler* sampler) const {
+	if (!hasMedia()) return 1.0f;
+	float T = 1.0f;
+	Ray3f ray(x0, (xz - x0).normalized());
+	m_mediaAccel.traverse(Ray3f(ray, ray.mint, (xz - x0).norm()), [&](const PMedia* media, float tEntry) {
+		MediaBoundaries medBound;
+		if (media->rayIntersectBoundaries(ray, medBound))
+			T *= media->lightTransmittance(x0, xz, emitter, medBound, sampler);
+		return T > 0.0f ? INFINITY : -INFINITY;
+	});
+	return T;
+}
+
+float Scene::opticalDepth(const Point3f& x0, const Point3f& xz, const Emitter* emitter, Sampler* sampler) const {
+	if (!hasMedia()) return 0.0f;
+	float depth = 0.0f;
+	Ray3f ray(x0, (xz - x0).normalized());
+	m_mediaAccel.traverse(Ray3f(ray, ray.mint, (xz - x0).norm()), [&](const PMedia* media, float tEntry) {
+		MediaBoundaries medBound;
+		if (media->rayIntersectBoundaries(ray, medBound))
+			depth += media->opticalDepth(x0, xz, emitter, medBound, sampler);
+		return INFINITY;
+	});
+	return depth;
 }
 
 void Scene::addChild(NoriObject *obj, const std::string& name) {
@@ -253,13 +325,15 @@ std::string Scene::toString() const {
 		"  %s  }\n"
 		"  medias = {\n"
 		"  %s  }\n"
+		"  mediaAccel = %s\n"
 		"]",
 		indent(m_integrator->toString()),
 		indent(m_sampler->toString()),
 		indent(m_camera->toString()),
 		indent(meshes, 2),
 		indent(lights, 2),
-		indent(medias, 2)
+		indent(medias, 2),
+		m_mediaAccel.toString()
 	);
 }
 
@@ -0,0 +1,200 @@
+#include <nori/sdtree.h>
+#include <tbb/parallel_for.h>
+
+NORI_NAMESPACE_BEGIN
+
+/// Largest float below 1
+static constexpr float OneMinusEpsilon = 0.99999994f;
+
+static void atomicAdd(std::atomic<float>& a, float v) {
+	float old = a.load(std::memory_order_relaxed);
+	while (!a.compare_exchange_weak(old, old + v, std::memory_order_relaxed)) ;
+}
+
+Point2f DTree::dirToCanonical(const Vector3f& w) {
+	float cosTheta = std::min(std::max(w.z(), -1.0f), 1.0f);
+	float phi = std::atan2(w.y(), w.x());
+	if (phi < 0.0f)
+		phi += 2.0f * M_PI;
+	return Point2f(std::min(0.5f * (cosTheta + 1.0f), OneMinusEpsilon), std::min(phi * INV_TWOPI, OneMinusEpsilon));
+}
+
+Vector3f DTree::canonicalToDir(const Point2f& p) {
+	float cosTheta = 2.0f * p.x() - 1.0f;
+	float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+	float phi = 2.0f * M_PI * p.y();
+	return Vector3f(sinTheta * std::cos(phi), sinTheta * std::sin(phi), cosTheta);
+}
+
+int DTree::pickQuadrant(const float* e, float total, Point2f& p) {
+	// Pick the column, then the quadrant within the column, reusing the sample
+	int c = 0;
+	float left = (e[0] + e[2]) / total;
+	if (p.x() < left) {
+		p.x() /= left;
+	} else {
+		p.x() = (p.x() - left) / (1.0f - left);
+		c |= 1;
+	}
+	float column = e[c] + e[c | 2];
+	float bottom = column > 0.0f ? e[c] / column : 0.5f;
+	if (p.y() < bottom) {
+		p.y() /= bottom;
+	} else {
+		p.y() = (p.y() - bottom) / (1.0f - bottom);
+		c |= 2;
+	}
+	p = Point2f(std::min(p.x(), OneMinusEpsilon), std::min(p.y(), OneMinusEpsilon));
+	return c;
+}
+
+DTree::Node::Node() {
+	for (int i = 0; i < 4; ++i) {
+		sum[i].store(0.0f, std::memory_order_relaxed);
+		child[i] = 0;
+	}
+}
+
+DTree::Node& DTree::Node::operator=(const Node& node) {
+	for (int i = 0; i < 4; ++i) {
+		sum[i].store(node.getSum(i), std::memory_order_relaxed);
+		child[i] = node.child[i];
+	}
+	return *this;
+}
+
+DTree::DTree() : m_nodes(1), m_depth(1) { }
+
+void DTree::record(const Vector3f& w, float value) {
+	if (!(value > 0.0f) || !std::isfinite(value))
+		return;
+	Point2f p = dirToCanonical(w);
+	uint32_t n = 0;
+	while (true) {
+		int c = (p.x() >= 0.5f ? 1 : 0) | (p.y() >= 0.5f ? 2 : 0);
+		Node& node = m_nodes[n];
+		atomicAdd(node.sum[c], value);
+		if (node.child[c] == 0)
+			return;
+		p = Point2f(2.0f * p.x() - (c & 1), 2.0f * p.y() - (c >> 1));
+		n = node.child[c];
+	}
+}
+
+float DTree::getTotal() const {
+	const Node& root = m_nodes[0];
+	return root.getSum(0) + root.getSum(1) + root.getSum(2) + root.getSum(3);
+}
+
+void DTree::refine(const DTree& tree, float threshold, int maxDepth) {
+	m_nodes.assign(1, Node());
+	m_depth = 1;
+	float total = tree.getTotal();
+	if (!(total > 0.0f))
+		return;
+
+	struct Item {
+		uint32_t node;
+		/// Matching node of \c tree, 0 past its leaves
+		uint32_t source;
+		/// Energy of the node, spread evenly past the leaves of \c tree
+		float energy;
+		int depth;
+	};
+	std::vector<Item> stack{ { 0, 0, total, 1 } };
+	while (!stack.empty()) {
+		Item item = stack.back();
+		stack.pop_back();
+		bool hasSource = item.node == 0 || item.source != 0;
+		for (int c = 0; c < 4; ++c) {
+			float energy = hasSource ? tree.m_nodes[item.source].getSum(c) : 0.25f * item.energy;
+			if (energy <= threshold * total || item.depth >= maxDepth)
+				continue;
+			uint32_t child = (uint32_t) m_nodes.size();
+			m_nodes.emplace_back();
+			m_nodes[item.node].child[c] = child;
+			uint32_t source = hasSource ? tree.m_nodes[item.source].child[c] : 0;
+			stack.push_back({ child, source, energy, item.depth + 1 });
+			m_depth = std::max(m_depth, item.depth + 1);
+		}
+	}
+}
+
+void SDTree::configure(const BoundingBox3f& bounds) {
+	// A cube, so that alternating the split axes keeps the cells cubic
+	Point3f center = bounds.getCenter();
+	float half = 0.5f * bounds.getExtents().maxCoeff() * 1.001f;
+	m_bounds = BoundingBox3f(center - Vector3f(half), center + Vector3f(half));
+	m_nodes.assign(1, Node{ 0, 0, 0 });
+	m_leaves.clear();
+	m_leaves.emplace_back();
+}
+
+uint32_t SDTree::findLeaf(const Point3f& pt) const {
+	Vector3f p = (pt - m_bounds.min).cwiseQuotient(m_bounds.getExtents());
+	p = p.cwiseMax(0.0f).cwiseMin(OneMinusEpsilon);
+	uint32_t n = 0;
+	while (m_nodes[n].child != 0) {
+		int axis = m_nodes[n].axis;
+		if (p[axis] < 0.5f) {
+			p[axis] *= 2.0f;
+			n = m_nodes[n].child;
+		} else {
+			p[axis] = 2.0f * p[axis] - 1.0f;
+			n = m_nodes[n].child + 1;
+		}
+	}
+	return m_nodes[n].leaf;
+}
+
+void SDTree::refine(uint32_t spatialThreshold, float directionalThreshold, int maxDepth) {
+	/* Split the busy leaves. The halves start with copies of the trees of
+	   their parent and half of its records, and are split again if needed */
+	for (size_t i = 0; i < m_nodes.size(); ++i) {
+		if (m_nodes[i].child != 0)
+			continue;
+		uint32_t leaf = m_nodes[i].leaf;
+		uint32_t count = m_leaves[leaf].count.load();
+		if (count <= spatialThreshold)
+			continue;
+		m_leaves[leaf].count.store(count / 2);
+		Leaf half(m_leaves[leaf]);
+		m_leaves.push_back(half);
+		uint8_t axis = (uint8_t) ((m_nodes[i].axis + 1) % 3);
+		m_nodes[i].child = (uint32_t) m_nodes.size();
+		m_nodes.push_back(Node{ 0, leaf, axis });
+		m_nodes.push_back(Node{ 0, (uint32_t) m_leaves.size() - 1, axis });
+	}
+
+	tbb::parallel_for(size_t(0), m_leaves.size(), [&](size_t i) {
+		Leaf& leaf = m_leaves[i];
+		leaf.sampling = leaf.building;
+		leaf.building.refine(leaf.sampling, directionalThreshold, maxDepth);
+		leaf.count.store(0);
+	});
+}
+
+size_t SDTree::getMemoryUsage() const {
+	size_t size = m_nodes.size() * sizeof(Node) + m_leaves.size() * sizeof(Leaf);
+	for (const Leaf& leaf : m_leaves)
+		size += (leaf.sampling.getNodeCount() + leaf.building.getNodeCount()) * 4 * (sizeof(float) + sizeof(uint32_t));
+	return size;
+}
+
+std::string SDTree::toString() const {
+	size_t nodes = 0;
+	int depth = 0;
+	for (const Leaf& leaf : m_leaves) {
+		nodes += leaf.sampling.getNodeCount();
+		depth = std::max(depth, leaf.sampling.getDepth());
+	}
+	return tfm::format(
+		"SDTree[\n"
+		"  leaves = %i,\n"
+		"  directionalNodes = %i,\n"
+		"  maxDirectionalDepth = %i\n"
+		"]",
+		m_leaves.size(), nodes, depth);
+}
+
+NORI_NAMESPACE_END
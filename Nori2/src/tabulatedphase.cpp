@@ -0,0 +1,274 @@
+#include <nori/phasefunction.h>
+#include <nori/frame.h>
+#include <nori/timer.h>
+#include <filesystem/resolver.h>
+#include <complex>
+#include <fstream>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Phase function tabulated over the cosine of the scattering angle
+ *
+ * The table holds the average of the phase function over \c resolution bins
+ * evenly spaced in cos(theta). It is read from a file of <tt>cosTheta value</tt>
+ * pairs (up to a constant, lines starting with '#' are skipped), or generated
+ * from a preset:
+ *  - "double_hg": blend of two Henyey-Greenstein lobes
+ *  - "mie": Lorenz-Mie scattering by water droplets with a gamma size
+ *    distribution, with the narrow forward peak, the fogbow and the glory
+ *    of clouds
+ *
+ * Sampling inverts the CDF of the table. A guide table gives the first
+ * candidate bin of each of \c resolution even slices of the CDF, so the bin
+ * is found in constant expected time.
+ */
+class TabulatedPhaseFunction : public PhaseFunction {
+public:
+	explicit TabulatedPhaseFunction(const PropertyList &propList) {
+		int resolution = propList.getInteger("resolution", 4096);
+		if (resolution < 2)
+			throw NoriException("TabulatedPhaseFunction: resolution must be at least 2 (got %i)", resolution);
+		std::string preset = propList.getString("preset", "");
+		std::vector<std::pair<double, double>> samples;
+		if (preset == "double_hg") {
+			float g1 = propList.getFloat("g1", 0.8f);
+			float g2 = propList.getFloat("g2", -0.3f);
+			float weight = propList.getFloat("weight", 0.9f);
+			if (std::abs(g1) >= 1.0f || std::abs(g2) >= 1.0f || weight < 0.0f || weight > 1.0f)
+				throw NoriException("TabulatedPhaseFunction: the double_hg preset needs |g1|, |g2| < 1 and weight in [0, 1]");
+			samples = sampleAngles(4 * resolution, [&](double cosTheta) {
+				return weight * henyeyGreenstein(g1, (float) cosTheta) + (1.0f - weight) * henyeyGreenstein(g2, (float) cosTheta);
+			});
+			m_source = tfm::format("double_hg (g1 = %f, g2 = %f, weight = %f)", g1, g2, weight);
+		} else if (preset == "mie") {
+			float radius = propList.getFloat("radius", 8.0f);
+			float variance = propList.getFloat("variance", 0.1f);
+			float wavelength = propList.getFloat("wavelength", 0.55f);
+			float ior = propList.getFloat("ior", 1.333f);
+			if (radius <= 0.0f || variance <= 0.0f || variance >= 1.0f / 3.0f || wavelength <= 0.0f || ior <= 0.0f)
+				throw NoriException("TabulatedPhaseFunction: the mie preset needs positive radius, wavelength and ior, and variance in (0, 1/3)");
+			cout << "Computing the Mie phase function .. ";
+			cout.flush();
+			Timer timer;
+			samples = mie(4 * resolution, radius, variance, wavelength, ior);
+			cout << "done (took " << timer.elapsedString() << ")." << endl;
+			m_source = tfm::format("mie (radius = %f um, variance = %f, wavelength = %f um, ior = %f)",
+			                       radius, variance, wavelength, ior);
+		} else if (preset.empty()) {
+			filesystem::path filename = getFileResolver()->resolve(propList.getString("filename"));
+			std::ifstream is(filename.str());
+			if (is.fail())
+				throw NoriException("Unable to open phase function table \"%s\"!", filename);
+			std::string line;
+			while (std::getline(is, line)) {
+				std::istringstream ls(line);
+				double cosTheta, value;
+				if (line.empty() || line[0] == '#' || !(ls >> cosTheta >> value))
+					continue;
+				if (cosTheta < -1.0 || cosTheta > 1.0 || value < 0.0)
+					throw NoriException("TabulatedPhaseFunction: invalid entry \"%s\" in \"%s\"", line, filename);
+				samples.emplace_back(cosTheta, value);
+			}
+			std::sort(samples.begin(), samples.end());
+			m_source = filename.str();
+		} else {
+			throw NoriException("TabulatedPhaseFunction: unknown preset \"%s\" (expected \"double_hg\" or \"mie\")", preset);
+		}
+		build(samples, resolution);
+	}
+
+	Color3f sample(PFQueryRecord& mRec, const Point2f &sample) const override {
+		int n = (int) m_values.size();
+		float u = sample.x();
+		int i = m_guide[std::min((int) (u * n), n - 1)];
+		while (i < n - 1 && m_cdf[i + 1] <= u)
+			++i;
+		float width = m_cdf[i + 1] - m_cdf[i];
+		float t = width > 0.0f ? std::min(std::max((u - m_cdf[i]) / width, 0.0f), 1.0f) : 0.5f;
+		float cosTheta = std::min(std::max(-1.0f + (i + t) * m_binWidth, -1.0f), 1.0f);
+		float sinTheta = std::sqrt(1.0f - cosTheta * cosTheta);
+		float phi = 2 * M_PI * sample.y();
+
+		Frame fr(mRec.wi);
+		mRec.wo = fr.toWorld(Vector3f(sinTheta * std::cos(phi), sinTheta * std::sin(phi), cosTheta));
+		return {1.0f};
+	}
+
+	Color3f eval(const PFQueryRecord &mRec) const override {
+		return lookup(mRec.wi.dot(mRec.wo));
+	}
+
+	float pdf(const PFQueryRecord &mRec) const override {
+		return lookup(mRec.wi.dot(mRec.wo));
+	}
+
+	float getMeanCosine() const override { return m_meanCosine; }
+
+	std::string toString() const override {
+		return tfm::format(
+				"TabulatedPhaseFunction[\n"
+				"  source = %s,\n"
+				"  resolution = %i,\n"
+				"  meanCosine = %f\n"
+				"]",
+				m_source, m_values.size(), m_meanCosine);
+	}
+
+private:
+	float lookup(float cosTheta) const {
+		int i = (int) ((cosTheta + 1.0f) / m_binWidth);
+		return m_values[std::min(std::max(i, 0), (int) m_values.size() - 1)];
+	}
+
+	/// Samples of \c f at \c count scattering angles evenly spaced in theta, in increasing cos(theta)
+	template <typename F>
+	static std::vector<std::pair<double, double>> sampleAngles(int count, const F& f) {
+		std::vector<std::pair<double, double>> samples(count);
+		for (int j = 0; j < count; ++j) {
+			double cosTheta = -std::cos(M_PI * j / (count - 1));
+			samples[j] = { cosTheta, f(cosTheta) };
+		}
+		return samples;
+	}
+
+	/**
+	 * \brief Lorenz-Mie coefficients of a sphere of size parameter \c x and
+	 * real relative refractive index \c m (Bohren and Huffman, BHMIE)
+	 */
+	static void mieCoefficients(double x, double m, std::vector<std::complex<double>>& a, std::vector<std::complex<double>>& b) {
+		int terms = (int) (x + 4.0 * std::cbrt(x) + 2.0);
+		double mx = m * x;
+		// Logarithmic derivative of the Riccati-Bessel function, stable downwards
+		int start = std::max(terms, (int) std::abs(mx)) + 15;
+		std::vector<double> D(start + 1, 0.0);
+		for (int n = start; n > 0; --n)
+			D[n - 1] = n / mx - 1.0 / (D[n] + n / mx);
+
+		a.resize(terms);
+		b.resize(terms);
+		double psi0 = std::cos(x), psi1 = std::sin(x), chi0 = -std::sin(x), chi1 = std::cos(x);
+		std::complex<double> xi1(psi1, -chi1);
+		for (int n = 1; n <= terms; ++n) {
+			double psi = (2.0 * n - 1.0) / x * psi1 - psi0;
+			double chi = (2.0 * n - 1.0) / x * chi1 - chi0;
+			std::complex<double> xi(psi, -chi);
+			double da = D[n] / m + n / x, db = m * D[n] + n / x;
+			a[n - 1] = (da * psi - psi1) / (da * xi - xi1);
+			b[n - 1] = (db * psi - psi1) / (db * xi - xi1);
+			psi0 = psi1; psi1 = psi;
+			chi0 = chi1; chi1 = chi;
+			xi1 = std::complex<double>(psi1, -chi1);
+		}
+	}
+
+	/**
+	 * \brief Mie phase function, up to a constant, averaged over a gamma
+	 * distribution of radii of effective \c radius and \c variance
+	 *
+	 * The distribution smooths out the ripples of single droplet sizes, which
+	 * real clouds do not show.
+	 */
+	static std::vector<std::pair<double, double>> mie(int count, double radius, double variance, double wavelength, double ior) {
+		std::vector<std::pair<double, double>> samples = sampleAngles(count, [](double) { return 0.0; });
+		const int radii = 32;
+		double rMin = radius * std::max(0.1, 1.0 - 4.0 * std::sqrt(variance));
+		double rMax = radius * (1.0 + 6.0 * std::sqrt(variance));
+		double dr = (rMax - rMin) / radii;
+		std::vector<std::complex<double>> a, b;
+		for (int k = 0; k < radii; ++k) {
+			double r = rMin + (k + 0.5) * dr;
+			// Gamma distribution of Hansen (1971), number of droplets of radius r
+			double weight = std::exp((1.0 - 3.0 * variance) / variance * std::log(r / radius) - (r - radius) / (radius * variance));
+			mieCoefficients(2.0 * M_PI * r / wavelength, ior, a, b);
+			for (auto& sample : samples) {
+				double mu = sample.first;
+				std::complex<double> S1(0.0), S2(0.0);
+				double pi0 = 0.0, pi1 = 1.0;
+				for (int n = 1; n <= (int) a.size(); ++n) {
+					double tau = n * mu * pi1 - (n + 1) * pi0;
+					double f = (2.0 * n + 1.0) / (n * (n + 1.0));
+					S1 += f * (a[n - 1] * pi1 + b[n - 1] * tau);
+					S2 += f * (a[n - 1] * tau + b[n - 1] * pi1);
+					double pi2 = ((2.0 * n + 1.0) * mu * pi1 - (n + 1.0) * pi0) / n;
+					pi0 = pi1;
+					pi1 = pi2;
+				}
+				sample.second += weight * (std::norm(S1) + std::norm(S2));
+			}
+		}
+		return samples;
+	}
+
+	/**
+	 * \brief Average the piecewise linear interpolation of \c samples over the
+	 * bins, extended with the end values to the whole range of cosines
+	 */
+	void build(std::vector<std::pair<double, double>> samples, int resolution) {
+		if (samples.empty())
+			throw NoriException("TabulatedPhaseFunction: the table is empty");
+		if (samples.front().first > -1.0)
+			samples.insert(samples.begin(), { -1.0, samples.front().second });
+		if (samples.back().first < 1.0)
+			samples.emplace_back(1.0, samples.back().second);
+
+		m_binWidth = 2.0f / resolution;
+		std::vector<double> mass(resolution, 0.0);
+		double binWidth = 2.0 / resolution;
+		for (size_t j = 0; j + 1 < samples.size(); ++j) {
+			double mu0 = samples[j].first, mu1 = samples[j + 1].first;
+			if (mu1 <= mu0)
+				continue;
+			double f0 = samples[j].second, slope = (samples[j + 1].second - f0) / (mu1 - mu0);
+			int first = std::max((int) ((mu0 + 1.0) / binWidth), 0);
+			int last = std::min((int) ((mu1 + 1.0) / binWidth), resolution - 1);
+			for (int i = first; i <= last; ++i) {
+				double lo = std::max(mu0, -1.0 + i * binWidth), hi = std::min(mu1, -1.0 + (i + 1) * binWidth);
+				if (hi > lo)
+					mass[i] += (hi - lo) * (f0 + 0.5 * slope * (lo + hi - 2.0 * mu0));
+			}
+		}
+		double total = 0.0, meanCosine = 0.0;
+		for (int i = 0; i < resolution; ++i) {
+			total += mass[i];
+			meanCosine += mass[i] * (-1.0 + (i + 0.5) * binWidth);
+		}
+		if (!(total > 0.0) || !std::isfinite(total))
+			throw NoriException("TabulatedPhaseFunction: the table does not integrate to a positive value");
+		m_meanCosine = (float) (meanCosine / total);
+
+		// Constant over each bin of cosines, and over the azimuth
+		m_values.resize(resolution);
+		m_cdf.resize(resolution + 1);
+		m_cdf[0] = 0.0f;
+		double cdf = 0.0;
+		for (int i = 0; i < resolution; ++i) {
+			m_values[i] = (float) (mass[i] / (total * 2.0 * M_PI * binWidth));
+			cdf += mass[i] / total;
+			m_cdf[i + 1] = (float) cdf;
+		}
+		m_cdf[resolution] = 1.0f;
+
+		// First bin whose CDF range reaches past the start of each slice
+		m_guide.resize(resolution);
+		int i = 0;
+		for (int j = 0; j < resolution; ++j) {
+			float u = (float) j / resolution;
+			while (i < resolution - 1 && m_cdf[i + 1] <= u)
+				++i;
+			m_guide[j] = i;
+		}
+	}
+
+	/// Phase function over each bin
+	std::vector<float> m_values;
+	/// CDF at the bin edges
+	std::vector<float> m_cdf;
+	std::vector<int> m_guide;
+	float m_binWidth;
+	float m_meanCosine;
+	std::string m_source;
+};
+
+NORI_REGISTER_CLASS(TabulatedPhaseFunction, "tabulated");
+NORI_NAMESPACE_END
@@ -0,0 +1,413 @@
+#include <nori/volume.h>
+#include <nori/timer.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+NORI_NAMESPACE_BEGIN
+
+void DensityGrid::setLayout(const BoundingBox3f& bbox, int resolution) {
+	if (resolution < 2)
+		throw NoriException("DensityGrid: the resolution must be at least 2 (got %i)", resolution);
+
+	m_bbox = bbox;
+	Vector3f extents = bbox.getExtents();
+	float spacing = extents.maxCoeff() / (resolution - 1);
+	for (int k = 0; k < 3; k++) {
+		m_res[k] = std::max(2, (int) std::ceil(extents[k] / spacing) + 1);
+		m_cellSize[k] = extents[k] / (m_res[k] - 1);
+		m_invCellSize[k] = m_cellSize[k] > 0 ? 1.0f / m_cellSize[k] : 0.0f;
+	}
+	m_data.resize((size_t) m_res.x() * m_res.y() * m_res.z());
+}
+
+void DensityGrid::build(const BoundingBox3f& bbox, int resolution, const std::function<float(const Point3f&)>& f) {
+	setLayout(bbox, resolution);
+	int rows = m_res.y() * m_res.z();
+	tbb::parallel_for(tbb::blocked_range<int>(0, rows), [&](const tbb::blocked_range<int>& range) {
+		for (int row = range.begin(); row < range.end(); ++row) {
+			int y = row % m_res.y(), z = row / m_res.y();
+			for (int x = 0; x < m_res.x(); x++)
+				m_data[index(x, y, z)] = f(m_bbox.min + Vector3f(x, y, z).cwiseProduct(m_cellSize));
+		}
+	});
+}
+
+void DensityGrid::bake(const DensityFunction* df, const BoundingBox3f& bbox, int resolution) {
+	setLayout(bbox, resolution);
+
+	cout << "Baking density into a " << m_res.x() << "x" << m_res.y() << "x" << m_res.z() << " grid .. ";
+	cout.flush();
+	Timer timer;
+
+	/* One task per row along x, each row is evaluated with a single batched call */
+	int rows = m_res.y() * m_res.z();
+	tbb::parallel_for(tbb::blocked_range<int>(0, rows), [&](const tbb::blocked_range<int>& range) {
+		std::vector<float> xs(m_res.x()), ys(m_res.x()), zs(m_res.x());
+		for (int x = 0; x < m_res.x(); x++)
+			xs[x] = m_bbox.min.x() + x * m_cellSize.x();
+		for (int row = range.begin(); row < range.end(); ++row) {
+			int y = row % m_res.y(), z = row / m_res.y();
+			std::fill(ys.begin(), ys.end(), m_bbox.min.y() + y * m_cellSize.y());
+			std::fill(zs.begin(), zs.end(), m_bbox.min.z() + z * m_cellSize.z());
+			df->evalBatch(xs.data(), ys.data(), zs.data(), &m_data[index(0, y, z)], m_res.x());
+		}
+	});
+
+	cout << "done (took " << timer.elapsedString() << " and " << memString(getMemoryUsage()) << ")." << endl;
+}
+
+void BrickGrid::bake(const DensityFunction* df, const BoundingBox3f& bbox, int resolution, int bits) {
+	if (resolution < 1)
+		throw NoriException("BrickGrid: the resolution must be positive (got %i)", resolution);
+	if (bits != 8 && bits != 16)
+		throw NoriException("BrickGrid: samples can only be quantized to 8 or 16 bits (got %i)", bits);
+
+	m_bbox = bbox;
+	m_bits = bits;
+	Vector3f extents = bbox.getExtents();
+	float spacing = extents.maxCoeff() / resolution;
+	for (int k = 0; k < 3; k++) {
+		m_cells[k] = std::max(1, (int) std::ceil(extents[k] / spacing));
+		m_bricks[k] = (m_cells[k] + BrickCells - 1) / BrickCells;
+		m_cellSize[k] = extents[k] / m_cells[k];
+		m_invCellSize[k] = m_cellSize[k] > 0 ? 1.0f / m_cellSize[k] : 0.0f;
+	}
+	int brickCount = m_bricks.x() * m_bricks.y() * m_bricks.z();
+
+	cout << "Baking density into " << m_bricks.x() << "x" << m_bricks.y() << "x" << m_bricks.z()
+		<< " bricks of " << (int) BrickCells << "^3 cells (" << bits << " bit) .. ";
+	cout.flush();
+	Timer timer;
+
+	/* Samples the vertices of brick b into values */
+	auto sampleBrick = [&](int b, std::vector<float>& xs, std::vector<float>& ys, std::vector<float>& zs, std::vector<float>& values) {
+		int bx = b % m_bricks.x(), by = (b / m_bricks.x()) % m_bricks.y(), bz = b / (m_bricks.x() * m_bricks.y());
+		for (int z = 0; z < BrickVerts; z++) {
+			for (int y = 0; y < BrickVerts; y++) {
+				for (int x = 0; x < BrickVerts; x++) {
+					int i = vertexIndex(x, y, z);
+					xs[i] = m_bbox.min.x() + (bx * BrickCells + x) * m_cellSize.x();
+					ys[i] = m_bbox.min.y() + (by * BrickCells + y) * m_cellSize.y();
+					zs[i] = m_bbox.min.z() + (bz * BrickCells + z) * m_cellSize.z();
+				}
+			}
+		}
+		df->evalBatch(xs.data(), ys.data(), zs.data(), values.data(), BrickSize);
+	};
+
+	/* First pass: the scale of each brick, 0 for the empty ones, so that
+	   neither the dense volume nor the bricks are ever resident twice */
+	const int maxQ = bits == 8 ? 255 : 65535;
+	std::vector<float> scales(brickCount, 0.0f);
+	tbb::parallel_for(tbb::blocked_range<int>(0, brickCount), [&](const tbb::blocked_range<int>& range) {
+		std::vector<float> xs(BrickSize), ys(BrickSize), zs(BrickSize), values(BrickSize);
+		for (int b = range.begin(); b < range.end(); ++b) {
+			sampleBrick(b, xs, ys, zs, values);
+			float maxValue = *std::max_element(values.begin(), values.end());
+			if (maxValue > 0.0f)
+				scales[b] = maxValue / maxQ;
+		}
+	});
+
+	/* Slots of the occupied bricks, and the compact arrays sized from their count */
+	m_index.assign(brickCount, -1);
+	m_scales.clear();
+	for (int b = 0; b < brickCount; b++) {
+		if (scales[b] <= 0.0f)
+			continue;
+		m_index[b] = (int) m_scales.size();
+		m_scales.push_back(scales[b]);
+	}
+	std::vector<float>().swap(scales);
+	size_t voxelCount = m_scales.size() * (size_t) BrickSize;
+	std::vector<uint8_t>(bits == 8 ? voxelCount : 0).swap(m_voxels8);
+	std::vector<uint16_t>(bits == 8 ? 0 : voxelCount).swap(m_voxels16);
+
+	/* Second pass: each occupied brick is sampled again, the density is
+	   deterministic, and quantized straight into its slot */
+	tbb::parallel_for(tbb::blocked_range<int>(0, brickCount), [&](const tbb::blocked_range<int>& range) {
+		std::vector<float> xs(BrickSize), ys(BrickSize), zs(BrickSize), values(BrickSize);
+		for (int b = range.begin(); b < range.end(); ++b) {
+			int slot = m_index[b];
+			if (slot < 0)
+				continue;
+			sampleBrick(b, xs, ys, zs, values);
+			size_t o = (size_t) slot * BrickSize;
+			for (int i = 0; i < BrickSize; i++) {
+				float q = std::min(std::round(std::max(0.0f, values[i]) / m_scales[slot]), (float) maxQ);
+				if (bits == 8) m_voxels8[o + i] = (uint8_t) q;
+				else m_voxels16[o + i] = (uint16_t) q;
+			}
+		}
+	});
+
+	cout << "done (took " << timer.elapsedString() << ", " << m_scales.size() << "/" << brickCount
+		<< " bricks occupied, " << memString(getMemoryUsage()) << ")." << endl;
+}
+
+float BrickGrid::skipEmpty(const Ray3f& ray, float t, float tMax) const {
+	Point3f p = ray(t);
+	Vector3f brickSize = m_cellSize * (float) BrickCells;
+	int b[3];
+	for (int k = 0; k < 3; k++) {
+		float q = (p[k] - m_bbox.min[k]) * m_invCellSize[k];
+		b[k] = clamp((int) std::floor(q) / BrickCells, 0, m_bricks[k] - 1);
+	}
+	if (m_index[brickIndex(b[0], b[1], b[2])] >= 0)
+		return t;
+
+	/* 3D DDA over the brick index */
+	int step[3];
+	float tNext[3], tDelta[3];
+	for (int k = 0; k < 3; k++) {
+		if (ray.d[k] > 0) {
+			step[k] = 1;
+			tNext[k] = (m_bbox.min[k] + (b[k] + 1) * brickSize[k] - ray.o[k]) * ray.dRcp[k];
+			tDelta[k] = brickSize[k] * ray.dRcp[k];
+		} else if (ray.d[k] < 0) {
+			step[k] = -1;
+			tNext[k] = (m_bbox.min[k] + b[k] * brickSize[k] - ray.o[k]) * ray.dRcp[k];
+			tDelta[k] = -brickSize[k] * ray.dRcp[k];
+		} else {
+			step[k] = 0;
+			tNext[k] = std::numeric_limits<float>::infinity();
+			tDelta[k] = std::numeric_limits<float>::infinity();
+		}
+	}
+
+	while (true) {
+		int k = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+		t = std::max(t, tNext[k]);
+		b[k] += step[k];
+		if (t >= tMax || b[k] < 0 || b[k] >= m_bricks[k])
+			return tMax;
+		tNext[k] += tDelta[k];
+		if (m_index[brickIndex(b[0], b[1], b[2])] >= 0)
+			return t;
+	}
+}
+
+float DensityGrid::maxValue(const BoundingBox3f& box) const {
+	int lo[3], hi[3];
+	for (int k = 0; k < 3; k++) {
+		lo[k] = clamp((int) std::floor((box.min[k] - m_bbox.min[k]) * m_invCellSize[k]), 0, m_res[k] - 1);
+		hi[k] = clamp((int) std::ceil((box.max[k] - m_bbox.min[k]) * m_invCellSize[k]), 0, m_res[k] - 1);
+	}
+	float result = 0.0f;
+	for (int z = lo[2]; z <= hi[2]; z++)
+		for (int y = lo[1]; y <= hi[1]; y++)
+			for (int x = lo[0]; x <= hi[0]; x++)
+				result = std::max(result, at(x, y, z));
+	return result;
+}
+
+float DensityGrid::minValue(const BoundingBox3f& box) const {
+	int lo[3], hi[3];
+	for (int k = 0; k < 3; k++) {
+		lo[k] = clamp((int) std::floor((box.min[k] - m_bbox.min[k]) * m_invCellSize[k]), 0, m_res[k] - 1);
+		hi[k] = clamp((int) std::ceil((box.max[k] - m_bbox.min[k]) * m_invCellSize[k]), 0, m_res[k] - 1);
+	}
+	float result = std::numeric_limits<float>::infinity();
+	for (int z = lo[2]; z <= hi[2]; z++)
+		for (int y = lo[1]; y <= hi[1]; y++)
+			for (int x = lo[0]; x <= hi[0]; x++)
+				result = std::min(result, at(x, y, z));
+	return std::max(result, 0.0f);
+}
+
+float BrickGrid::maxValue(const BoundingBox3f& box) const {
+	/* Range of vertices, in global vertex coordinates */
+	int lo[3], hi[3];
+	for (int k = 0; k < 3; k++) {
+		lo[k] = clamp((int) std::floor((box.min[k] - m_bbox.min[k]) * m_invCellSize[k]), 0, m_cells[k]);
+		hi[k] = clamp((int) std::ceil((box.max[k] - m_bbox.min[k]) * m_invCellSize[k]), 0, m_cells[k]);
+	}
+	float result = 0.0f;
+	for (int bz = lo[2] / BrickCells; bz <= std::min(hi[2] / BrickCells, m_bricks.z() - 1); bz++) {
+		for (int by = lo[1] / BrickCells; by <= std::min(hi[1] / BrickCells, m_bricks.y() - 1); by++) {
+			for (int bx = lo[0] / BrickCells; bx <= std::min(hi[0] / BrickCells, m_bricks.x() - 1); bx++) {
+				int slot = m_index[brickIndex(bx, by, bz)];
+				if (slot < 0)
+					continue;
+				int o[3] = { bx * BrickCells, by * BrickCells, bz * BrickCells };
+				int maxQ = 0;
+				for (int z = std::max(lo[2], o[2]); z <= std::min(hi[2], o[2] + BrickCells); z++) {
+					for (int y = std::max(lo[1], o[1]); y <= std::min(hi[1], o[1] + BrickCells); y++) {
+						for (int x = std::max(lo[0], o[0]); x <= std::min(hi[0], o[0] + BrickCells); x++) {
+							size_t i = (size_t) slot * BrickSize + vertexIndex(x - o[0], y - o[1], z - o[2]);
+							maxQ = std::max(maxQ, m_bits == 8 ? (int) m_voxels8[i] : (int) m_voxels16[i]);
+						}
+					}
+				}
+				result = std::max(result, maxQ * m_scales[slot]);
+			}
+		}
+	}
+	return result;
+}
+
+float BrickGrid::minValue(const BoundingBox3f& box) const {
+	int lo[3], hi[3];
+	for (int k = 0; k < 3; k++) {
+		lo[k] = clamp((int) std::floor((box.min[k] - m_bbox.min[k]) * m_invCellSize[k]), 0, m_cells[k]);
+		hi[k] = clamp((int) std::ceil((box.max[k] - m_bbox.min[k]) * m_invCellSize[k]), 0, m_cells[k]);
+	}
+	float result = std::numeric_limits<float>::infinity();
+	for (int bz = lo[2] / BrickCells; bz <= std::min(hi[2] / BrickCells, m_bricks.z() - 1); bz++) {
+		for (int by = lo[1] / BrickCells; by <= std::min(hi[1] / BrickCells, m_bricks.y() - 1); by++) {
+			for (int bx = lo[0] / BrickCells; bx <= std::min(hi[0] / BrickCells, m_bricks.x() - 1); bx++) {
+				int slot = m_index[brickIndex(bx, by, bz)];
+				// Empty bricks are zero everywhere
+				if (slot < 0)
+					return 0.0f;
+				int o[3] = { bx * BrickCells, by * BrickCells, bz * BrickCells };
+				int minQ = std::numeric_limits<int>::max();
+				for (int z = std::max(lo[2], o[2]); z <= std::min(hi[2], o[2] + BrickCells); z++) {
+					for (int y = std::max(lo[1], o[1]); y <= std::min(hi[1], o[1] + BrickCells); y++) {
+						for (int x = std::max(lo[0], o[0]); x <= std::min(hi[0], o[0] + BrickCells); x++) {
+							size_t i = (size_t) slot * BrickSize + vertexIndex(x - o[0], y - o[1], z - o[2]);
+							minQ = std::min(minQ, m_bits == 8 ? (int) m_voxels8[i] : (int) m_voxels16[i]);
+						}
+					}
+				}
+				result = std::min(result, minQ * m_scales[slot]);
+			}
+		}
+	}
+	return std::isfinite(result) ? result : 0.0f;
+}
+
+void MajorantGrid::build(const BoundingBox3f& bbox, int resolution,
+		const std::function<float(const BoundingBox3f&)>& maxDensity,
+		const std::function<float(const BoundingBox3f&)>& minDensity) {
+	if (resolution < 1)
+		throw NoriException("MajorantGrid: the resolution must be positive (got %i)", resolution);
+
+	m_bbox = bbox;
+	Vector3f extents = bbox.getExtents();
+	float spacing = extents.maxCoeff() / resolution;
+	for (int k = 0; k < 3; k++) {
+		m_res[k] = std::max(1, (int) std::ceil(extents[k] / spacing));
+		m_cellSize[k] = extents[k] / m_res[k];
+		m_invCellSize[k] = m_cellSize[k] > 0 ? 1.0f / m_cellSize[k] : 0.0f;
+	}
+	m_data.resize((size_t) m_res.x() * m_res.y() * m_res.z());
+	if (minDensity)
+		m_controls.resize(m_data.size());
+	else
+		m_controls.clear();
+
+	cout << "Building a " << m_res.x() << "x" << m_res.y() << "x" << m_res.z() << " majorant grid .. ";
+	cout.flush();
+	Timer timer;
+
+	tbb::parallel_for(tbb::blocked_range<int>(0, (int) m_data.size()), [&](const tbb::blocked_range<int>& range) {
+		for (int i = range.begin(); i < range.end(); ++i) {
+			int x = i % m_res.x(), y = (i / m_res.x()) % m_res.y(), z = i / (m_res.x() * m_res.y());
+			Point3f cellMin = m_bbox.min + Vector3f(x, y, z).cwiseProduct(m_cellSize);
+			BoundingBox3f cell(cellMin, cellMin + m_cellSize);
+			m_data[i] = maxDensity(cell);
+			if (minDensity)
+				m_controls[i] = std::min(minDensity(cell), m_data[i]);
+		}
+	});
+
+	cout << "done (took " << timer.elapsedString() << " and " << memString(getMemoryUsage()) << ")." << endl;
+}
+
+float MajorantGrid::getMean() const {
+	double sum = 0.0;
+	for (float m : m_data)
+		sum += m;
+	return m_data.empty() ? 0.0f : (float) (sum / m_data.size());
+}
+
+MajorantIterator::MajorantIterator(const MajorantGrid& grid, const Ray3f& ray, float tMin, float tMax)
+	: m_grid(grid), m_t(tMin), m_tMax(tMax) {
+	Point3f p = ray(tMin);
+	for (int k = 0; k < 3; k++) {
+		float q = (p[k] - grid.m_bbox.min[k]) * grid.m_invCellSize[k];
+		m_cell[k] = clamp((int) std::floor(q), 0, grid.m_res[k] - 1);
+		if (ray.d[k] > 0) {
+			m_step[k] = 1;
+			m_tNext[k] = (grid.m_bbox.min[k] + (m_cell[k] + 1) * grid.m_cellSize[k] - ray.o[k]) * ray.dRcp[k];
+			m_tDelta[k] = grid.m_cellSize[k] * ray.dRcp[k];
+		} else if (ray.d[k] < 0) {
+			m_step[k] = -1;
+			m_tNext[k] = (grid.m_bbox.min[k] + m_cell[k] * grid.m_cellSize[k] - ray.o[k]) * ray.dRcp[k];
+			m_tDelta[k] = -grid.m_cellSize[k] * ray.dRcp[k];
+		} else {
+			m_step[k] = 0;
+			m_tNext[k] = std::numeric_limits<float>::infinity();
+			m_tDelta[k] = std::numeric_limits<float>::infinity();
+		}
+	}
+}
+
+bool MajorantIterator::next(float& t0, float& t1, float& majorant, float& control) {
+	if (m_t >= m_tMax)
+		return false;
+
+	int k = m_tNext[0] < m_tNext[1] ? (m_tNext[0] < m_tNext[2] ? 0 : 2) : (m_tNext[1] < m_tNext[2] ? 1 : 2);
+	t0 = m_t;
+	t1 = clamp(m_tNext[k], m_t, m_tMax);
+	majorant = m_grid.at(m_cell[0], m_cell[1], m_cell[2]);
+	control = m_grid.controlAt(m_cell[0], m_cell[1], m_cell[2]);
+
+	int cell = m_cell[k] + m_step[k];
+	if (cell < 0 || cell >= m_grid.m_res[k]) {
+		/* Leaving the grid: the last cell covers the rest of the interval */
+		t1 = m_tMax;
+	} else {
+		m_cell[k] = cell;
+		m_tNext[k] += m_tDelta[k];
+	}
+	m_t = t1;
+	return true;
+}
+
+std::string MajorantGrid::toString() const {
+	if (!isBuilt())
+		return "MajorantGrid[]";
+	return tfm::format(
+			"MajorantGrid[\n"
+			"  resolution = %i x %i x %i,\n"
+			"  mean = %f,\n"
+			"  controls = %s,\n"
+			"  memory = %s\n"
+			"]",
+			m_res.x(), m_res.y(), m_res.z(),
+			getMean(),
+			hasControls() ? "yes" : "no",
+			memString(getMemoryUsage()));
+}
+
+std::string BrickGrid::toString() const {
+	if (!isBaked())
+		return "BrickGrid[]";
+	return tfm::format(
+			"BrickGrid[\n"
+			"  bricks = %i x %i x %i,\n"
+			"  occupied = %i,\n"
+			"  bits = %i,\n"
+			"  memory = %s\n"
+			"]",
+			m_bricks.x(), m_bricks.y(), m_bricks.z(),
+			(int) m_scales.size(),
+			m_bits,
+			memString(getMemoryUsage()));
+}
+
+std::string DensityGrid::toString() const {
+	if (!isBaked())
+		return "DensityGrid[]";
+	return tfm::format(
+			"DensityGrid[\n"
+			"  resolution = %i x %i x %i,\n"
+			"  memory = %s\n"
+			"]",
+			m_res.x(), m_res.y(), m_res.z(),
+			memString(getMemoryUsage()));
+}
+
+NORI_NAMESPACE_END